@@ -5,9 +5,32 @@
 #include <fstream>
 #include <sstream>
 #include <iostream>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <filesystem>
+#include <initializer_list>
+#include <map>
+#include <string_view>
+#include <vector>
+#include <algorithm>
 
 #include <glad/glad.h>
 
+// linked programs are kept here by glGetProgramBinary, one file per set of sources and driver
+const char* const SHADER_CACHE_DIR = "shader_cache";
+
+// 64 bit FNV-1a, continue a hash by passing it back in
+inline uint64_t fnv1a(std::string_view data, uint64_t hash = 14695981039346656037ull)
+{
+	for (unsigned char c : data)
+	{
+		hash ^= c;
+		hash *= 1099511628211ull;
+	}
+	return hash;
+}
+
 class Shader
 {
 public:
@@ -16,153 +39,271 @@ public:
 	Shader(const GLchar* vertexPath, const GLchar* fragmentPath, const GLchar* tessControlPath, const GLchar* tessEvalPath)
 	{
 		// 1. retrieve the vertex/fragment source code from filepath
-		std::string vertexCode;
-		std::string fragmentCode;
-		std::string tessControlCode;
-		std::string tessEvalCode;
+		std::string vertexCode = readSource(vertexPath);
+		std::string fragmentCode = readSource(fragmentPath);
+		std::string tessControlCode = readSource(tessControlPath);
+		std::string tessEvalCode = readSource(tessEvalPath);
 
+		auto start = std::chrono::steady_clock::now();
+		std::filesystem::path cachePath = cachePathFor({ &vertexCode, &fragmentCode, &tessControlCode, &tessEvalCode });
 
-		std::ifstream vShaderFile;
-		std::ifstream fShaderFile;
-		std::ifstream tcShaderFile;
-		std::ifstream teShaderFile;
-		// ensures ifstream objects can throw exceptions
-		vShaderFile.exceptions(std::ifstream::badbit);
-		fShaderFile.exceptions(std::ifstream::badbit);
-		tcShaderFile.exceptions(std::ifstream::badbit);
-		teShaderFile.exceptions(std::ifstream::badbit);
-
-		try
+		if (loadProgramBinary(cachePath))
 		{
-			//open files
-			vShaderFile.open(vertexPath);
-			fShaderFile.open(fragmentPath);
-			tcShaderFile.open(tessControlPath);
-			teShaderFile.open(tessEvalPath);
-			std::stringstream vShaderStream, fShaderStream, tcShaderStream, teShaderStream;
-			// read file buffers contents into stream
-			vShaderStream << vShaderFile.rdbuf();
-			fShaderStream << fShaderFile.rdbuf();
-			tcShaderStream << tcShaderFile.rdbuf();
-			teShaderStream << teShaderFile.rdbuf();
-			// close file handlers
-			vShaderFile.close();
-			fShaderFile.close();
-			tcShaderFile.close();
-			teShaderFile.close();
-			// convert stream into string
-			vertexCode = vShaderStream.str();
-			fragmentCode = fShaderStream.str();
-			tessControlCode = tcShaderStream.str();
-			tessEvalCode = teShaderStream.str();
+			cacheUniformLocations();
+			std::cout << "Shader program loaded from " << cachePath.string() << " in " << millisecondsSince(start) << " ms" << std::endl;
+			return;
 		}
-		catch (std::ifstream::failure e)
+
+		// 2. Compile Shaders and link them
+		buildProgram({
+			{ GL_VERTEX_SHADER, &vertexCode, "VERTEX" },
+			{ GL_FRAGMENT_SHADER, &fragmentCode, "FRAGMENT" },
+			{ GL_TESS_CONTROL_SHADER, &tessControlCode, "TESSELATION::CONTROL" },
+			{ GL_TESS_EVALUATION_SHADER, &tessEvalCode, "TESSELATION::EVALUATION" } }, "", cachePath);
+		std::cout << "Shader program compiled in " << millisecondsSince(start) << " ms" << std::endl;
+	}
+
+	// compute program from a single file, cached like the others
+	explicit Shader(const GLchar* computePath)
+	{
+		std::string computeCode = readSource(computePath);
+
+		auto start = std::chrono::steady_clock::now();
+		std::filesystem::path cachePath = cachePathFor({ &computeCode });
+		if (loadProgramBinary(cachePath))
 		{
-			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ" << std::endl;
+			cacheUniformLocations();
+			std::cout << "Compute program " << computePath << " loaded from cache in " << millisecondsSince(start) << " ms" << std::endl;
+			return;
 		}
-		
-		const GLchar* vShaderCode = vertexCode.c_str();
-		const GLchar* fShaderCode = fragmentCode.c_str();
-		const GLchar* tcShaderCode = tessControlCode.c_str();
-		const GLchar* teShaderCode = tessEvalCode.c_str();
-		
-		// 2. Compile Shaders
-		GLuint vertex, fragment, tessControl, tessEvaluation;
-		GLint success;
-		GLchar infoLog[512];
-		// vertex shader
-		vertex = glCreateShader(GL_VERTEX_SHADER);
-		glShaderSource(vertex, 1, &vShaderCode, NULL);
-		glCompileShader(vertex);
-		// print compile errors if any
-		glGetShaderiv(vertex, GL_COMPILE_STATUS, &success);
-		if (!success)
+
+		buildProgram({ { GL_COMPUTE_SHADER, &computeCode, "COMPUTE" } }, computePath, cachePath);
+		std::cout << "Compute program " << computePath << " compiled in " << millisecondsSince(start) << " ms" << std::endl;
+	}
+
+	// uses
+	void use()
+	{
+		glUseProgram(ID);
+	}
+
+	// location of an active uniform, -1 (ignored by glUniform*) for unknown or optimized out names
+	GLint location(std::string_view name) const
+	{
+		auto it = UniformLocations.find(name);
+		return it != UniformLocations.end() ? it->second : -1;
+	}
+
+	void setVec2(std::string_view name, float x, float y) const
+	{
+		glUniform2f(location(name), x, y);
+	}
+	void setVec3(std::string_view name, const glm::vec3& value) const
+	{
+		glUniform3fv(location(name), 1, &value[0]);
+	}
+	void setVec3(std::string_view name, float x, float y, float z) const
+	{
+		glUniform3f(location(name), x, y, z);
+	}
+	void setVec2Array(std::string_view name, const glm::vec2* values, int count) const
+	{
+		glUniform2fv(location(name), count, &values[0][0]);
+	}
+	void setVec4Array(std::string_view name, const glm::vec4* values, int count) const
+	{
+		glUniform4fv(location(name), count, &values[0][0]);
+	}
+	void setMat4(std::string_view name, const glm::mat4& mat) const
+	{
+		glUniformMatrix4fv(location(name), 1, GL_FALSE, &mat[0][0]);
+	}
+
+	void setFloat(std::string_view name, const float value) const
+	{
+		glUniform1f(location(name), value);
+	}
+
+	void setInt(std::string_view name, int value) const
+	{
+		glUniform1i(location(name), value);
+	}
+
+private:
+	// active uniforms by name, looked up once after linking so the setters never query GL.
+	// std::less<> lets the string_view setters search without building a std::string
+	std::map<std::string, GLint, std::less<>> UniformLocations;
+
+	static double millisecondsSince(std::chrono::steady_clock::time_point start)
+	{
+		return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+
+	// a cached binary is only valid for the exact sources on the same driver
+	static std::filesystem::path cachePathFor(std::initializer_list<const std::string*> sources)
+	{
+		uint64_t key = fnv1a("");
+		for (const std::string* part : sources)
+			key = fnv1a(std::string_view(part->c_str(), part->size() + 1), key);
+		for (GLenum name : { GL_VENDOR, GL_RENDERER, GL_VERSION })
 		{
-			glGetShaderInfoLog(vertex, 512, NULL, infoLog);
-			std::cout << "ERROR::SHADER::VERTEX::COMPILATION_FAILED\n" << infoLog << std::endl;
+			const GLubyte* value = glGetString(name);
+			key = fnv1a(value ? (const char*)value : "", key);
 		}
+		char keyName[32];
+		snprintf(keyName, sizeof(keyName), "%016llx.bin", (unsigned long long)key);
+		return std::filesystem::path(SHADER_CACHE_DIR) / keyName;
+	}
 
-		// Fragment Shader
-		fragment = glCreateShader(GL_FRAGMENT_SHADER);
-		glShaderSource(fragment, 1, &fShaderCode, NULL);
-		glCompileShader(fragment);
-		glGetShaderiv(fragment, GL_COMPILE_STATUS, &success);
-		// print compile error if any
-		if (!success)
+	static std::string readSource(const GLchar* path)
+	{
+		std::ifstream file;
+		// ensures ifstream objects can throw exceptions
+		file.exceptions(std::ifstream::badbit);
+		try
 		{
-			glGetShaderInfoLog(fragment, 512, NULL, infoLog);
-			std::cout << "ERROR::SHADER::FRAGMENT::COMPILATION_FAILED\n" << infoLog << std::endl;
+			file.open(path);
+			std::stringstream stream;
+			stream << file.rdbuf();
+			file.close();
+			return stream.str();
 		}
-
-		// Tesselation Control Shader
-		tessControl = glCreateShader(GL_TESS_CONTROL_SHADER);
-		glShaderSource(tessControl, 1, &tcShaderCode, NULL);
-		glCompileShader(tessControl);
-		glGetShaderiv(tessControl, GL_COMPILE_STATUS, &success);
-		if (!success) {
-			glGetShaderInfoLog(tessControl, 512, NULL, infoLog);
-			std::cout << "ERROR::SHADER::TESSELATION::CONTROL::COMPILATION_FAILED:\n" << infoLog << std::endl;
+		catch (const std::ifstream::failure&)
+		{
+			std::cout << "ERROR::SHADER::FILE_NOT_SUCCESFULLY_READ " << path << std::endl;
+			return std::string();
 		}
+	}
 
-		// tesselation evaluation shader
-		tessEvaluation = glCreateShader(GL_TESS_EVALUATION_SHADER);
-		glShaderSource(tessEvaluation, 1, &teShaderCode, NULL);
-		glCompileShader(tessEvaluation);
-		glGetShaderiv(tessEvaluation, GL_COMPILE_STATUS, &success);
-		if (!success) {
-			glGetShaderInfoLog(tessEvaluation, 512, NULL, infoLog);
-			std::cout << "ERROR::SHADER::TESSELATION::EVALUATION::COMPILATION_FAILED:\n" << infoLog << std::endl;
+	struct Stage
+	{
+		GLenum Type;
+		const std::string* Code;
+		// for the error messages
+		const char* Name;
+	};
+
+	// compiles and links the stages into ID, caches the binary and the uniform locations. errors are printed with
+	// the stage name and the source, if given
+	void buildProgram(std::initializer_list<Stage> stages, const char* source, const std::filesystem::path& cachePath)
+	{
+		GLint success;
+		GLchar infoLog[512];
+		std::vector<GLuint> shaders;
+		for (const Stage& stage : stages)
+		{
+			const GLchar* code = stage.Code->c_str();
+			GLuint shader = glCreateShader(stage.Type);
+			glShaderSource(shader, 1, &code, NULL);
+			glCompileShader(shader);
+			// print compile errors if any
+			glGetShaderiv(shader, GL_COMPILE_STATUS, &success);
+			if (!success)
+			{
+				glGetShaderInfoLog(shader, 512, NULL, infoLog);
+				std::cout << "ERROR::SHADER::" << stage.Name << "::COMPILATION_FAILED " << source << "\n" << infoLog << std::endl;
+			}
+			shaders.push_back(shader);
 		}
-		
-		// Shader Program
+
 		ID = glCreateProgram();
-		glAttachShader(ID, vertex);
-		glAttachShader(ID, fragment);
-		glAttachShader(ID, tessControl);
-		glAttachShader(ID, tessEvaluation);
+		for (GLuint shader : shaders)
+			glAttachShader(ID, shader);
+		glProgramParameteri(ID, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, GL_TRUE);
 		glLinkProgram(ID);
 		// print linking errors if any
 		glGetProgramiv(ID, GL_LINK_STATUS, &success);
 		if (!success)
 		{
 			glGetProgramInfoLog(ID, 512, NULL, infoLog);
-			std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED\n" << infoLog << std::endl;
+			std::cout << "ERROR::SHADER::PROGRAM::LINKING_FAILED " << source << "\n" << infoLog << std::endl;
+		}
+		else
+		{
+			saveProgramBinary(cachePath);
 		}
 		// Delete the shaders as they're linked into our program now and no longer necessary
-		glDeleteShader(vertex);
-		glDeleteShader(fragment);
-		glDeleteShader(tessControl);
-		glDeleteShader(tessEvaluation);
-	}
+		for (GLuint shader : shaders)
+			glDeleteShader(shader);
 
-	// uses
-	void use()
-	{
-		glUseProgram(ID);
+		cacheUniformLocations();
 	}
 
-	void setVec3(const std::string& name, const glm::vec3& value) const
-	{
-		glUniform3fv(glGetUniformLocation(ID, name.c_str()), 1, &value[0]);
-	}
-	void setVec3(const std::string& name, float x, float y, float z) const
-	{
-		glUniform3f(glGetUniformLocation(ID, name.c_str()), x, y, z);
-	}
-	void setMat4(const std::string name, const glm::mat4& mat) const
+	// cache file: binary format (GLenum) followed by the program binary
+	bool loadProgramBinary(const std::filesystem::path& path)
 	{
-		glUniformMatrix4fv(glGetUniformLocation(ID, name.c_str()), 1, GL_FALSE, &mat[0][0]);
+		std::ifstream file(path, std::ios::binary | std::ios::ate);
+		if (!file)
+			return false;
+		std::streamsize size = file.tellg();
+		GLenum format = 0;
+		if (size <= (std::streamsize)sizeof(format))
+			return false;
+		std::vector<char> binary((size_t)size - sizeof(format));
+		file.seekg(0);
+		file.read((char*)&format, sizeof(format));
+		file.read(binary.data(), binary.size());
+		if (!file)
+			return false;
+
+		ID = glCreateProgram();
+		glProgramBinary(ID, format, binary.data(), (GLsizei)binary.size());
+		GLint success;
+		glGetProgramiv(ID, GL_LINK_STATUS, &success);
+		if (!success)
+		{
+			// driver update or a binary from another GPU, compile from source instead
+			glDeleteProgram(ID);
+			ID = 0;
+			return false;
+		}
+		return true;
 	}
 
-	void setFloat(const std::string name, const float value) const
+	void saveProgramBinary(const std::filesystem::path& path) const
 	{
-		glUniform1f(glGetUniformLocation(ID, name.c_str()), value);
+		GLint formats = 0, length = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formats);
+		glGetProgramiv(ID, GL_PROGRAM_BINARY_LENGTH, &length);
+		if (formats == 0 || length <= 0)
+			return;
+		std::vector<char> binary(length);
+		GLenum format = 0;
+		glGetProgramBinary(ID, length, nullptr, &format, binary.data());
+
+		std::error_code error;
+		std::filesystem::create_directories(path.parent_path(), error);
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		file.write((const char*)&format, sizeof(format));
+		file.write(binary.data(), binary.size());
+		if (!file)
+			std::cout << "ERROR::SHADER::PROGRAM::CACHE_WRITE_FAILED " << path.string() << std::endl;
 	}
 
-	void setInt(const std::string& name, int value) const
+	void cacheUniformLocations()
 	{
-		glUniform1i(glGetUniformLocation(ID, name.c_str()), value);
+		UniformLocations.clear();
+		GLint count = 0, maxLength = 0;
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORMS, &count);
+		glGetProgramiv(ID, GL_ACTIVE_UNIFORM_MAX_LENGTH, &maxLength);
+		std::vector<GLchar> name(std::max(maxLength, 1));
+		for (GLint i = 0; i < count; i++)
+		{
+			GLsizei length = 0;
+			GLint size;
+			GLenum type;
+			glGetActiveUniform(ID, (GLuint)i, (GLsizei)name.size(), &length, &size, &type, name.data());
+			std::string uniform(name.data(), length);
+			// block members and atomic counters have no location
+			GLint location = glGetUniformLocation(ID, uniform.c_str());
+			if (location < 0)
+				continue;
+			// arrays are reported as name[0], the setters use the plain name
+			if (uniform.size() > 3 && uniform.compare(uniform.size() - 3, 3, "[0]") == 0)
+				uniform.resize(uniform.size() - 3);
+			UniformLocations[uniform] = location;
+		}
 	}
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,72 @@
+#ifndef CAMERA_MOTION_H
+#define CAMERA_MOTION_H
+
+#include <cmath>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+#include "camera.h"
+
+// smoothed velocity of the camera, to guess where it will be a moment from now.
+// position moves on a straight line and yaw/pitch keep turning at their current rate
+class CameraMotion
+{
+public:
+	// seconds over which velocity changes are smoothed
+	float TimeConstant = 0.15f;
+
+	glm::vec3 Velocity = glm::vec3(0.0f);
+	float YawRate = 0.0f;   // degrees per second
+	float PitchRate = 0.0f;
+
+	void update(const Camera& camera, float deltaTime)
+	{
+		if (!HasLast || deltaTime <= 0.0f)
+		{
+			LastPosition = camera.Position;
+			LastYaw = camera.Yaw;
+			LastPitch = camera.Pitch;
+			HasLast = true;
+			return;
+		}
+		float k = 1.0f - std::exp(-deltaTime / TimeConstant);
+		Velocity += ((camera.Position - LastPosition) / deltaTime - Velocity) * k;
+		YawRate += ((camera.Yaw - LastYaw) / deltaTime - YawRate) * k;
+		PitchRate += ((camera.Pitch - LastPitch) / deltaTime - PitchRate) * k;
+		LastPosition = camera.Position;
+		LastYaw = camera.Yaw;
+		LastPitch = camera.Pitch;
+	}
+
+	// nothing to predict while the camera sits still
+	bool moving() const
+	{
+		return glm::dot(Velocity, Velocity) > 0.01f || std::abs(YawRate) > 0.1f || std::abs(PitchRate) > 0.1f;
+	}
+
+	glm::vec3 predictPosition(const Camera& camera, float seconds) const
+	{
+		return camera.Position + Velocity * seconds;
+	}
+
+	// view matrix the camera would have, built like Camera::GetViewMatrix
+	glm::mat4 predictView(const Camera& camera, float seconds) const
+	{
+		float yaw = glm::radians(camera.Yaw + YawRate * seconds);
+		float pitch = glm::radians(std::clamp(camera.Pitch + PitchRate * seconds, -89.0f, 89.0f));
+		glm::vec3 front = glm::normalize(glm::vec3(std::cos(yaw) * std::cos(pitch), std::sin(pitch), std::sin(yaw) * std::cos(pitch)));
+		glm::vec3 right = glm::normalize(glm::cross(front, camera.WorldUp));
+		glm::vec3 up = glm::normalize(glm::cross(right, front));
+		glm::vec3 position = predictPosition(camera, seconds);
+		return glm::lookAt(position, position + front, up);
+	}
+
+private:
+	glm::vec3 LastPosition = glm::vec3(0.0f);
+	float LastYaw = 0.0f;
+	float LastPitch = 0.0f;
+	bool HasLast = false;
+};
+
+#endif
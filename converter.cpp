@@ -0,0 +1,279 @@
+// HeightConverter: turns the heightmaps the renderer can load (PNG, raw R16/R32F, ESRI ASCII grids)
+// into a tiled .hrt mip pyramid, see terrain_file.h for the layout.
+//
+// usage: HeightConverter <input> <output.hrt> [options]
+//   --size WxH      dimensions of a raw .r16/.r32 input, square inputs are detected from the file size
+//   --scale S       meters per normalized 16 bit sample (default 163)
+//   --offset O      meters at sample 0 (default -5.199)
+//   --tile N        tile size without the border (default 256, at most 16384)
+//   --border N      border samples on each side of a tile (default 1, less than the tile size)
+//   --threads N     worker threads, 0 for one per hardware thread (default 0)
+
+#define STB_IMAGE_IMPLEMENTATION
+#include "stb_image.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include "heightmap.h"
+#include "terrain_file.h"
+#include "thread_pool.h"
+
+struct ConverterOptions
+{
+	const char* InputPath = nullptr;
+	const char* OutputPath = nullptr;
+	int RawWidth = 0;
+	int RawHeight = 0;
+	float Scale = 163.0f;
+	float Offset = -5.199f;
+	uint32_t TileSize = 256;
+	uint32_t Border = 1;
+	unsigned Threads = 0;
+};
+
+template<typename T>
+struct PyramidLevel
+{
+	int Width = 0;
+	int Height = 0;
+	std::vector<T> Data;
+
+	T at(int x, int y) const
+	{
+		x = std::clamp(x, 0, Width - 1);
+		y = std::clamp(y, 0, Height - 1);
+		return Data[(size_t)y * Width + x];
+	}
+};
+
+inline uint16_t averageSamples(uint16_t a, uint16_t b, uint16_t c, uint16_t d)
+{
+	return (uint16_t)(((uint32_t)a + b + c + d + 2) / 4);
+}
+
+inline float averageSamples(float a, float b, float c, float d)
+{
+	return (a + b + c + d) * 0.25f;
+}
+
+// 2x2 box filter, odd sizes round down like glGenerateMipmap does
+template<typename T>
+PyramidLevel<T> downsample(const PyramidLevel<T>& src, ThreadPool& pool)
+{
+	PyramidLevel<T> dst;
+	dst.Width = std::max(1, src.Width / 2);
+	dst.Height = std::max(1, src.Height / 2);
+	dst.Data.resize((size_t)dst.Width * dst.Height);
+	pool.parallelFor(dst.Height, [&](size_t y) {
+		int sy = (int)y * 2;
+		T* row = &dst.Data[y * dst.Width];
+		for (int x = 0; x < dst.Width; x++)
+		{
+			int sx = x * 2;
+			row[x] = averageSamples(src.at(sx, sy), src.at(sx + 1, sy), src.at(sx, sy + 1), src.at(sx + 1, sy + 1));
+		}
+	});
+	return dst;
+}
+
+inline float normalizedSample(uint16_t s) { return s / 65535.0f; }
+inline float normalizedSample(float s) { return s; }
+
+template<typename T>
+bool writePyramid(std::vector<T>&& baseData, const Heightmap& map, const ConverterOptions& options, ThreadPool& pool)
+{
+	auto start = std::chrono::steady_clock::now();
+
+	// build every level in memory first, each one depends on the previous
+	std::vector<PyramidLevel<T>> levels(1);
+	levels[0].Width = map.Width;
+	levels[0].Height = map.Height;
+	levels[0].Data = std::move(baseData);
+	int levelCount = mipLevelCount(map.Width, map.Height);
+	for (int l = 1; l < levelCount; l++)
+		levels.push_back(downsample(levels[l - 1], pool));
+
+	auto pyramidDone = std::chrono::steady_clock::now();
+
+	// lay out the tables and give every tile an aligned slot
+	TerrainFileHeader header = {};
+	memcpy(header.Magic, TERRAIN_MAGIC, 4);
+	header.Version = TERRAIN_VERSION;
+	header.Width = map.Width;
+	header.Height = map.Height;
+	header.TileSize = options.TileSize;
+	header.Border = options.Border;
+	header.LevelCount = levelCount;
+	header.Format = map.Format;
+	header.Scale = map.Scale;
+	header.Offset = map.Offset;
+	header.MinHeight = map.MinHeight;
+	header.MaxHeight = map.MaxHeight;
+
+	std::vector<TerrainLevel> levelTable(levelCount);
+	for (int l = 0; l < levelCount; l++)
+	{
+		TerrainLevel& lv = levelTable[l];
+		lv.Width = levels[l].Width;
+		lv.Height = levels[l].Height;
+		lv.TilesX = (lv.Width + options.TileSize - 1) / options.TileSize;
+		lv.TilesY = (lv.Height + options.TileSize - 1) / options.TileSize;
+		lv.FirstTile = header.TileCount;
+		header.TileCount += lv.TilesX * lv.TilesY;
+	}
+
+	size_t stride = options.TileSize + 2 * (size_t)options.Border;
+	size_t tileBytes = stride * stride * sizeof(T);
+	uint64_t tablesEnd = sizeof(TerrainFileHeader) + levelTable.size() * sizeof(TerrainLevel) + (uint64_t)header.TileCount * sizeof(TerrainTile);
+	uint64_t slotBytes = alignTerrainOffset(tileBytes);
+	std::vector<TerrainTile> tileTable(header.TileCount);
+	for (uint32_t t = 0; t < header.TileCount; t++)
+		tileTable[t].DataOffset = alignTerrainOffset(tablesEnd) + t * slotBytes;
+
+	std::ofstream out(options.OutputPath, std::ios::binary | std::ios::trunc);
+	if (!out)
+	{
+		std::cout << "ERROR::CONVERTER::FAILED_TO_CREATE " << options.OutputPath << std::endl;
+		return false;
+	}
+	std::mutex outMutex;
+
+	// one task per tile over all levels: copy out the tile with its border, find its range and write it to its slot
+	pool.parallelFor(header.TileCount, [&](size_t t) {
+		int l = 0;
+		while (l + 1 < levelCount && levelTable[l + 1].FirstTile <= t)
+			l++;
+		const TerrainLevel& lv = levelTable[l];
+		const PyramidLevel<T>& level = levels[l];
+		uint32_t index = (uint32_t)t - lv.FirstTile;
+		int x0 = (int)((index % lv.TilesX) * options.TileSize) - (int)options.Border;
+		int y0 = (int)((index / lv.TilesX) * options.TileSize) - (int)options.Border;
+
+		std::vector<T> tile(stride * stride);
+		float lo = std::numeric_limits<float>::max();
+		float hi = -std::numeric_limits<float>::max();
+		for (size_t row = 0; row < stride; row++)
+		{
+			int y = y0 + (int)row;
+			bool rowInside = row >= options.Border && row < options.Border + options.TileSize && y < level.Height;
+			for (size_t col = 0; col < stride; col++)
+			{
+				int x = x0 + (int)col;
+				T s = level.at(x, y);
+				tile[row * stride + col] = s;
+				if (rowInside && col >= options.Border && col < options.Border + options.TileSize && x < level.Width)
+				{
+					lo = std::min(lo, normalizedSample(s));
+					hi = std::max(hi, normalizedSample(s));
+				}
+			}
+		}
+		tileTable[t].MinHeight = std::min(lo * map.Scale, hi * map.Scale) + map.Offset;
+		tileTable[t].MaxHeight = std::max(lo * map.Scale, hi * map.Scale) + map.Offset;
+
+		std::lock_guard<std::mutex> lock(outMutex);
+		out.seekp((std::streamoff)tileTable[t].DataOffset);
+		out.write((const char*)tile.data(), tileBytes);
+	});
+
+	out.seekp(0);
+	out.write((const char*)&header, sizeof(header));
+	out.write((const char*)levelTable.data(), levelTable.size() * sizeof(TerrainLevel));
+	out.write((const char*)tileTable.data(), tileTable.size() * sizeof(TerrainTile));
+	out.close();
+	if (!out)
+	{
+		std::cout << "ERROR::CONVERTER::WRITE_FAILED " << options.OutputPath << std::endl;
+		return false;
+	}
+
+	auto end = std::chrono::steady_clock::now();
+	auto ms = [](auto a, auto b) { return (long long)std::chrono::duration_cast<std::chrono::milliseconds>(b - a).count(); };
+	std::cout << "Wrote " << options.OutputPath << ": " << levelCount << " levels, " << header.TileCount << " tiles of "
+		<< options.TileSize << "x" << options.TileSize << " (+" << options.Border << " border)" << std::endl;
+	std::cout << "Pyramid: " << ms(start, pyramidDone) << " ms, tiles: " << ms(pyramidDone, end) << " ms on "
+		<< pool.size() << " threads" << std::endl;
+	return true;
+}
+
+void printUsage()
+{
+	std::cout << "usage: HeightConverter <input> <output.hrt> [--size WxH] [--scale S] [--offset O] [--tile N] [--border N] [--threads N]" << std::endl;
+	std::cout << "inputs: .png (8/16 bit), .r16/.raw, .r32/.f32, .asc (ESRI ASCII grid)" << std::endl;
+}
+
+bool parseOptions(int argc, char** argv, ConverterOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string arg = argv[i];
+		bool hasValue = i + 1 < argc;
+		if (arg == "--size" && hasValue)
+		{
+			if (sscanf(argv[++i], "%dx%d", &options.RawWidth, &options.RawHeight) != 2)
+				return false;
+		}
+		else if (arg == "--scale" && hasValue)
+			options.Scale = std::strtof(argv[++i], nullptr);
+		else if (arg == "--offset" && hasValue)
+			options.Offset = std::strtof(argv[++i], nullptr);
+		else if (arg == "--tile" && hasValue)
+			options.TileSize = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--border" && hasValue)
+			options.Border = (uint32_t)std::strtoul(argv[++i], nullptr, 10);
+		else if (arg == "--threads" && hasValue)
+			options.Threads = (unsigned)std::strtoul(argv[++i], nullptr, 10);
+		else if (arg.rfind("--", 0) == 0)
+			return false;
+		else if (!options.InputPath)
+			options.InputPath = argv[i];
+		else if (!options.OutputPath)
+			options.OutputPath = argv[i];
+		else
+			return false;
+	}
+	// the same limits the reader checks
+	return options.InputPath && options.OutputPath && options.TileSize > 0 && options.TileSize <= TERRAIN_MAX_TILE_SIZE
+		&& options.Border < options.TileSize;
+}
+
+int main(int argc, char** argv)
+{
+	ConverterOptions options;
+	if (!parseOptions(argc, argv, options))
+	{
+		printUsage();
+		return 1;
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	Heightmap map;
+	bool loaded;
+	std::string ext = heightmapExtension(options.InputPath);
+	if (options.RawWidth > 0 && (ext == "r16" || ext == "raw"))
+		loaded = loadHeightmapRaw(options.InputPath, HEIGHT_R16, options.RawWidth, options.RawHeight, map, options.Scale, options.Offset);
+	else if (options.RawWidth > 0 && (ext == "r32" || ext == "f32"))
+		loaded = loadHeightmapRaw(options.InputPath, HEIGHT_R32F, options.RawWidth, options.RawHeight, map, 1.0f, 0.0f);
+	else
+		loaded = loadHeightmap(options.InputPath, map, options.Scale, options.Offset);
+	if (!loaded)
+		return 1;
+	auto loadMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start).count();
+	std::cout << "Loaded " << options.InputPath << " (" << map.Width << "x" << map.Height << ", "
+		<< (map.Format == HEIGHT_R16 ? "R16" : "R32F") << ") in " << loadMs << " ms" << std::endl;
+
+	ThreadPool pool(options.Threads);
+	bool written = map.Format == HEIGHT_R16
+		? writePyramid(std::move(map.Data16), map, options, pool)
+		: writePyramid(std::move(map.Data32), map, options, pool);
+	return written ? 0 : 1;
+}
@@ -0,0 +1,98 @@
+#ifndef FRAME_CONSTANTS_H
+#define FRAME_CONSTANTS_H
+
+#include <cstring>
+#include <iostream>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+
+// uniform block binding of FrameConstants in the shaders
+const GLuint FRAME_CONSTANTS_BINDING = 0;
+
+// std140 mirror of the FrameConstants block in the tessellation shaders, the matrices are combined once here
+// so the shaders do a single multiply per vertex
+struct FrameConstants
+{
+	glm::mat4 Projection;
+	glm::mat4 View;
+	glm::mat4 Model;
+	glm::mat4 ModelView;
+	glm::mat4 ModelViewProjection;
+	glm::vec4 FrustumPlanes[6];
+	glm::vec3 CameraPos;
+	float Padding0;
+	glm::vec2 ViewportSize;
+	float Padding1[2];
+};
+static_assert(sizeof(FrameConstants) == 448, "FrameConstants has to match the std140 layout");
+
+// one persistently mapped buffer holding a FrameConstants slot per frame in flight.
+// a frame writes its slot and binds that range, the fence of the slot makes sure the GPU is done with it
+// before it comes around again
+class FrameUniforms
+{
+public:
+	static const int FRAMES = 3;
+
+	void init()
+	{
+		GLint alignment = 256;
+		glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &alignment);
+		Stride = ((GLsizeiptr)sizeof(FrameConstants) + alignment - 1) / alignment * alignment;
+
+		GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+		glGenBuffers(1, &Buffer);
+		glBindBuffer(GL_UNIFORM_BUFFER, Buffer);
+		glBufferStorage(GL_UNIFORM_BUFFER, Stride * FRAMES, nullptr, flags);
+		Mapped = (char*)glMapBufferRange(GL_UNIFORM_BUFFER, 0, Stride * FRAMES, flags);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		if (!Mapped)
+			std::cout << "ERROR::FRAME_CONSTANTS::MAP_FAILED" << std::endl;
+	}
+
+	void destroy()
+	{
+		for (GLsync& fence : Fences)
+			if (fence)
+				glDeleteSync(fence);
+		glBindBuffer(GL_UNIFORM_BUFFER, Buffer);
+		glUnmapBuffer(GL_UNIFORM_BUFFER);
+		glBindBuffer(GL_UNIFORM_BUFFER, 0);
+		glDeleteBuffers(1, &Buffer);
+	}
+
+	// write this frame's slot and bind it, call before drawing
+	void update(const FrameConstants& constants)
+	{
+		if (!Mapped)
+			return;
+		if (Fences[Current])
+		{
+			// only waits when the CPU is FRAMES frames ahead
+			glClientWaitSync(Fences[Current], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+			glDeleteSync(Fences[Current]);
+			Fences[Current] = 0;
+		}
+		memcpy(Mapped + Stride * Current, &constants, sizeof(FrameConstants));
+		glBindBufferRange(GL_UNIFORM_BUFFER, FRAME_CONSTANTS_BINDING, Buffer, Stride * Current, sizeof(FrameConstants));
+	}
+
+	// call after the last draw reading the slot
+	void endFrame()
+	{
+		if (!Mapped)
+			return;
+		Fences[Current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		Current = (Current + 1) % FRAMES;
+	}
+
+private:
+	GLuint Buffer = 0;
+	char* Mapped = nullptr;
+	GLsizeiptr Stride = 0;
+	GLsync Fences[FRAMES] = {};
+	int Current = 0;
+};
+
+#endif
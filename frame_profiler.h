@@ -0,0 +1,210 @@
+#ifndef FRAME_PROFILER_H
+#define FRAME_PROFILER_H
+
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include "imgui.h"
+
+// passes of a frame, in the order they run
+enum ProfilerPass
+{
+	PASS_TERRAIN, // offscreen scene up to the blit into the window
+	PASS_IMGUI,
+	PASS_SWAP,    // swap and event polling
+	PASS_COUNT
+};
+
+// CPU and GPU time of every pass over the last HISTORY frames, with percentiles of the frame time.
+// GPU times come from GL_TIMESTAMP queries at the pass boundaries. timestamps don't nest like GL_TIME_ELAPSED, so
+// they sit fine around the terrain timer. like GpuTimer every frame in flight has its own queries, picked up once
+// available, so a frame's GPU times are filled in a few frames after its CPU times
+class FrameProfiler
+{
+public:
+	static const int FRAMES = 4;
+	static const int HISTORY = 300;
+
+	struct Sample
+	{
+		float FrameMs = 0.0f;
+		float CpuMs[PASS_COUNT] = {};
+		// negative until the queries came back
+		float GpuMs[PASS_COUNT] = { -1.0f, -1.0f, -1.0f };
+	};
+
+	void init()
+	{
+		glGenQueries(FRAMES * PASS_COUNT * 2, &Queries[0][0][0]);
+		History.resize(HISTORY);
+	}
+
+	void destroy()
+	{
+		glDeleteQueries(FRAMES * PASS_COUNT * 2, &Queries[0][0][0]);
+	}
+
+	// call once at the top of the frame
+	void beginFrame()
+	{
+		collect();
+		auto now = std::chrono::steady_clock::now();
+		if (Frames > 0)
+			History[Current].FrameMs = milliseconds(FrameStart, now);
+		FrameStart = now;
+		Frames++;
+		Current = (Current + 1) % HISTORY;
+		History[Current] = Sample();
+		// still in flight after FRAMES frames, dropped
+		Issued[Slot] = false;
+	}
+
+	void begin(ProfilerPass pass)
+	{
+		PassStart[pass] = std::chrono::steady_clock::now();
+		glQueryCounter(Queries[Slot][pass][0], GL_TIMESTAMP);
+	}
+
+	void end(ProfilerPass pass)
+	{
+		History[Current].CpuMs[pass] = milliseconds(PassStart[pass], std::chrono::steady_clock::now());
+		glQueryCounter(Queries[Slot][pass][1], GL_TIMESTAMP);
+		if (pass == PASS_COUNT - 1)
+		{
+			// every pass of the frame is in, its queries can be picked up from now on
+			Issued[Slot] = true;
+			SlotSample[Slot] = Current;
+			Slot = (Slot + 1) % FRAMES;
+		}
+	}
+
+	// the window with the per pass table, the frame time graph and the percentiles
+	void draw()
+	{
+		static const char* names[PASS_COUNT] = { "Terrain", "ImGui", "Swap" };
+		ImGui::Begin("Profiler");
+		// the newest frame with GPU times, the current one has neither yet
+		const Sample* latest = nullptr;
+		int count = recentCount();
+		for (int age = 1; age < count && !latest; age++)
+		{
+			const Sample& sample = History[(Current + HISTORY - age) % HISTORY];
+			if (sample.GpuMs[PASS_COUNT - 1] >= 0.0f)
+				latest = &sample;
+		}
+		const Sample& last = History[(Current + HISTORY - 1) % HISTORY];
+		ImGui::Text("%-8s %8s %8s", "Pass", "CPU ms", "GPU ms");
+		for (int p = 0; p < PASS_COUNT; p++)
+			ImGui::Text("%-8s %8.3f %8.3f", names[p], last.CpuMs[p], latest ? latest->GpuMs[p] : 0.0f);
+
+		// oldest first for the graph
+		std::vector<float> frameMs;
+		for (int age = count - 1; age >= 1; age--)
+			frameMs.push_back(History[(Current + HISTORY - age) % HISTORY].FrameMs);
+		if (!frameMs.empty())
+		{
+			std::vector<float> sorted = frameMs;
+			std::sort(sorted.begin(), sorted.end());
+			ImGui::PlotLines("##frames", frameMs.data(), (int)frameMs.size(), 0, "frame time (ms)", 0.0f,
+				std::max(33.3f, sorted.back()), ImVec2(0.0f, 80.0f));
+			ImGui::Text("Last %d frames, ms: p50 %.2f p95 %.2f p99 %.2f max %.2f", (int)sorted.size(),
+				percentile(sorted, 0.50f), percentile(sorted, 0.95f), percentile(sorted, 0.99f), sorted.back());
+		}
+		if (ImGui::Button("Dump CSV"))
+			dump("profile.csv");
+		ImGui::End();
+	}
+
+	// every frame in the history, oldest first
+	void dump(const std::string& csvPath) const
+	{
+		static const char* names[PASS_COUNT] = { "terrain", "imgui", "swap" };
+		std::ofstream csv(csvPath);
+		if (!csv)
+		{
+			std::cout << "ERROR::PROFILER::FILE_NOT_WRITABLE " << csvPath << std::endl;
+			return;
+		}
+		csv << "frame,frame_ms";
+		for (int p = 0; p < PASS_COUNT; p++)
+			csv << "," << names[p] << "_cpu_ms," << names[p] << "_gpu_ms";
+		csv << "\n";
+		int count = recentCount();
+		for (int age = count - 1; age >= 1; age--)
+		{
+			const Sample& sample = History[(Current + HISTORY - age) % HISTORY];
+			csv << Frames - 1 - age << "," << sample.FrameMs;
+			for (int p = 0; p < PASS_COUNT; p++)
+			{
+				csv << "," << sample.CpuMs[p] << ",";
+				if (sample.GpuMs[p] >= 0.0f)
+					csv << sample.GpuMs[p];
+			}
+			csv << "\n";
+		}
+		std::cout << "Profile of " << count - 1 << " frames written to " << csvPath << std::endl;
+	}
+
+private:
+	GLuint Queries[FRAMES][PASS_COUNT][2] = {};
+	bool Issued[FRAMES] = {};
+	int SlotSample[FRAMES] = {};
+	int Slot = 0;
+
+	std::vector<Sample> History;
+	// entry of the frame being recorded
+	int Current = 0;
+	int Frames = 0;
+	std::chrono::steady_clock::time_point FrameStart;
+	std::chrono::steady_clock::time_point PassStart[PASS_COUNT];
+
+	static float milliseconds(std::chrono::steady_clock::time_point from, std::chrono::steady_clock::time_point to)
+	{
+		return std::chrono::duration<float, std::milli>(to - from).count();
+	}
+
+	// entries in use including the current one
+	int recentCount() const
+	{
+		return Frames < HISTORY ? Frames : HISTORY;
+	}
+
+	// nearest rank
+	static float percentile(const std::vector<float>& sorted, float p)
+	{
+		size_t rank = (size_t)std::ceil(p * sorted.size());
+		return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1];
+	}
+
+	void collect()
+	{
+		for (int age = FRAMES; age >= 1; age--)
+		{
+			int slot = (Slot + FRAMES - age) % FRAMES;
+			if (!Issued[slot])
+				continue;
+			// the last query of the frame finishes last
+			GLint available = 0;
+			glGetQueryObjectiv(Queries[slot][PASS_COUNT - 1][1], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				continue;
+			Sample& sample = History[SlotSample[slot]];
+			for (int p = 0; p < PASS_COUNT; p++)
+			{
+				GLuint64 start = 0, end = 0;
+				glGetQueryObjectui64v(Queries[slot][p][0], GL_QUERY_RESULT, &start);
+				glGetQueryObjectui64v(Queries[slot][p][1], GL_QUERY_RESULT, &end);
+				sample.GpuMs[p] = (float)((end - start) / 1000000.0);
+			}
+			Issued[slot] = false;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,51 @@
+#ifndef FRUSTUM_H
+#define FRUSTUM_H
+
+#include <glm/glm.hpp>
+
+// the six clip planes of a view projection matrix in world space, normals pointing inwards
+// plane order is left, right, bottom, top, near, far
+struct Frustum
+{
+	glm::vec4 Planes[6];
+
+	// box is outside when all of it lies behind one plane, so boxes near a frustum corner can pass without being visible
+	bool intersectsBox(const glm::vec3& boxMin, const glm::vec3& boxMax) const
+	{
+		for (const glm::vec4& plane : Planes)
+		{
+			// corner furthest along the plane normal
+			glm::vec3 p(plane.x >= 0.0f ? boxMax.x : boxMin.x,
+				plane.y >= 0.0f ? boxMax.y : boxMin.y,
+				plane.z >= 0.0f ? boxMax.z : boxMin.z);
+			if (glm::dot(glm::vec3(plane), p) + plane.w < 0.0f)
+				return false;
+		}
+		return true;
+	}
+};
+
+// Gribb/Hartmann: each plane is the last row of the matrix plus or minus one of the other rows
+inline Frustum extractFrustum(const glm::mat4& viewProjection)
+{
+	// glm is column major, m[c][r]
+	const glm::mat4& m = viewProjection;
+	glm::vec4 row0(m[0][0], m[1][0], m[2][0], m[3][0]);
+	glm::vec4 row1(m[0][1], m[1][1], m[2][1], m[3][1]);
+	glm::vec4 row2(m[0][2], m[1][2], m[2][2], m[3][2]);
+	glm::vec4 row3(m[0][3], m[1][3], m[2][3], m[3][3]);
+
+	Frustum frustum;
+	frustum.Planes[0] = row3 + row0;
+	frustum.Planes[1] = row3 - row0;
+	frustum.Planes[2] = row3 + row1;
+	frustum.Planes[3] = row3 - row1;
+	frustum.Planes[4] = row3 + row2;
+	frustum.Planes[5] = row3 - row2;
+	// normalized so the distances compare in world units
+	for (glm::vec4& plane : frustum.Planes)
+		plane /= glm::length(glm::vec3(plane));
+	return frustum;
+}
+
+#endif
@@ -0,0 +1,110 @@
+#ifndef GPU_CULLER_H
+#define GPU_CULLER_H
+
+#include <vector>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "Shader.h"
+#include "height_pyramid.h"
+
+// lod buckets of the compute pass, one indirect draw each
+const int GPU_CULL_BUCKETS = 4;
+// storage buffer bindings shared by cull_compute_shader.txt and the vertex shader
+const GLuint GPU_CULL_BOUNDS_BINDING = 1;
+const GLuint GPU_CULL_PATCHES_BINDING = 2;
+const GLuint GPU_CULL_COMMANDS_BINDING = 3;
+
+// frustum culling of the patch grid in a compute pass ahead of the draw, so dropped patches cost no vertex or TCS
+// invocations and the CPU side is the same handful of calls for any patch count.
+// the pass writes the indices of the surviving patches into one range per lod bucket and counts them straight into
+// the DrawArraysIndirectCommand of that bucket. the vertex shader finds its patch at gl_BaseInstance + gl_VertexID / 4
+// the buckets drop nothing, they only order the draws: the densely tessellated near patches go first and fill the
+// depth buffer before the cheap far ones. the TCS skips its own frustum test in this mode and keeps only the hi-z one
+class GpuCuller
+{
+public:
+	void destroy()
+	{
+		glDeleteBuffers(1, &BoundsBuffer);
+		glDeleteBuffers(1, &PatchBuffer);
+		glDeleteBuffers(1, &CommandBuffer);
+		BoundsBuffer = PatchBuffer = CommandBuffer = 0;
+		Pyramid = nullptr;
+		Rez = 0;
+	}
+
+	// runs the pass, call after PatchCounter::begin with the frame constants bound
+	void cull(Shader& shader, const HeightPyramid& pyramid, int rez, glm::vec2 terrainSize, float triangleSize, bool frustumCull)
+	{
+		if (&pyramid != Pyramid || rez != Rez)
+			resize(pyramid, rez);
+
+		// empty commands, every bucket starting at its own range of the patch list
+		DrawArraysIndirectCommand commands[GPU_CULL_BUCKETS];
+		for (int b = 0; b < GPU_CULL_BUCKETS; b++)
+			commands[b] = { 0, 1, 0, (GLuint)(b * rez * rez) };
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, CommandBuffer);
+		glBufferSubData(GL_DRAW_INDIRECT_BUFFER, 0, sizeof(commands), commands);
+
+		shader.use();
+		shader.setInt("patchRez", rez);
+		shader.setVec2("terrainSize", terrainSize.x, terrainSize.y);
+		shader.setFloat("triangleSize", triangleSize);
+		shader.setInt("frustumCull", frustumCull);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GPU_CULL_BOUNDS_BINDING, BoundsBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GPU_CULL_PATCHES_BINDING, PatchBuffer);
+		glBindBufferBase(GL_SHADER_STORAGE_BUFFER, GPU_CULL_COMMANDS_BINDING, CommandBuffer);
+		glDispatchCompute((rez * rez + 63) / 64, 1, 1);
+		// the TCS counts into the same atomic counters
+		glMemoryBarrier(GL_SHADER_STORAGE_BARRIER_BIT | GL_COMMAND_BARRIER_BIT | GL_ATOMIC_COUNTER_BARRIER_BIT);
+	}
+
+	// the buckets in order, nearest first. the terrain shader and an empty VAO have to be bound
+	void draw()
+	{
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, CommandBuffer);
+		glMultiDrawArraysIndirect(GL_PATCHES, nullptr, GPU_CULL_BUCKETS, 0);
+		glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+	}
+
+private:
+	struct DrawArraysIndirectCommand
+	{
+		GLuint Count;
+		GLuint InstanceCount;
+		GLuint First;
+		GLuint BaseInstance;
+	};
+
+	GLuint BoundsBuffer = 0;
+	GLuint PatchBuffer = 0;
+	GLuint CommandBuffer = 0;
+	const HeightPyramid* Pyramid = nullptr;
+	int Rez = 0;
+
+	// per patch bounds once per grid, patch list and commands sized for it
+	void resize(const HeightPyramid& pyramid, int rez)
+	{
+		destroy();
+		Pyramid = &pyramid;
+		Rez = rez;
+		std::vector<glm::vec2> bounds((size_t)rez * rez);
+		for (int i = 0; i < rez; i++)
+			for (int j = 0; j < rez; j++)
+				pyramid.bounds(i / (float)rez, j / (float)rez, (i + 1) / (float)rez, (j + 1) / (float)rez, bounds[i * rez + j].x, bounds[i * rez + j].y);
+
+		glGenBuffers(1, &BoundsBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, BoundsBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, bounds.size() * sizeof(glm::vec2), bounds.data(), GL_STATIC_DRAW);
+		glGenBuffers(1, &PatchBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, PatchBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, (GLsizeiptr)GPU_CULL_BUCKETS * rez * rez * sizeof(GLuint), nullptr, GL_DYNAMIC_COPY);
+		glGenBuffers(1, &CommandBuffer);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, CommandBuffer);
+		glBufferData(GL_SHADER_STORAGE_BUFFER, GPU_CULL_BUCKETS * sizeof(DrawArraysIndirectCommand), nullptr, GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_SHADER_STORAGE_BUFFER, 0);
+	}
+};
+
+#endif
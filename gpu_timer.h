@@ -0,0 +1,82 @@
+#ifndef GPU_TIMER_H
+#define GPU_TIMER_H
+
+#include <glad/glad.h>
+
+// GL_TIME_ELAPSED around a span of GL commands, one query per frame in flight.
+// results are picked up once available, so like PatchCounter the numbers lag a few frames but never stall
+class GpuTimer
+{
+public:
+	static const int FRAMES = 4;
+
+	// newest finished measurement in milliseconds, and the frame it was started in
+	double Milliseconds = 0.0;
+	unsigned Frame = 0;
+
+	void init()
+	{
+		glGenQueries(FRAMES, Queries);
+	}
+
+	void destroy()
+	{
+		glDeleteQueries(FRAMES, Queries);
+	}
+
+	// returns true when a new measurement came in
+	bool begin()
+	{
+		bool updated = collect();
+		// still in flight after FRAMES frames, it is dropped
+		Started[Current] = false;
+		glBeginQuery(GL_TIME_ELAPSED, Queries[Current]);
+		return updated;
+	}
+
+	// frame number the next begin/end pair will be measured as
+	unsigned frames() const
+	{
+		return Counter;
+	}
+
+	void end()
+	{
+		glEndQuery(GL_TIME_ELAPSED);
+		Started[Current] = true;
+		StartFrame[Current] = Counter++;
+		Current = (Current + 1) % FRAMES;
+	}
+
+private:
+	GLuint Queries[FRAMES] = {};
+	bool Started[FRAMES] = {};
+	unsigned StartFrame[FRAMES] = {};
+	int Current = 0;
+	unsigned Counter = 0;
+
+	// oldest first so the newest available result ends up in Milliseconds
+	bool collect()
+	{
+		bool updated = false;
+		for (int age = FRAMES; age >= 1; age--)
+		{
+			int slot = (Current + FRAMES - age) % FRAMES;
+			if (!Started[slot])
+				continue;
+			GLint available = 0;
+			glGetQueryObjectiv(Queries[slot], GL_QUERY_RESULT_AVAILABLE, &available);
+			if (!available)
+				continue;
+			GLuint64 nanoseconds = 0;
+			glGetQueryObjectui64v(Queries[slot], GL_QUERY_RESULT, &nanoseconds);
+			Milliseconds = nanoseconds / 1000000.0;
+			Frame = StartFrame[slot];
+			Started[slot] = false;
+			updated = true;
+		}
+		return updated;
+	}
+};
+
+#endif
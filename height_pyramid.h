@@ -0,0 +1,281 @@
+#ifndef HEIGHT_PYRAMID_H
+#define HEIGHT_PYRAMID_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include "heightmap.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+#ifdef HR_SSE2
+// interleaved (min, max) uint16 pairs: min of the even lanes, max of the odd lanes.
+// SSE2 only compares signed 16 bit, flipping the top bit maps unsigned onto signed order
+inline __m128i mergeMinMax16(__m128i a, __m128i b)
+{
+	const __m128i bias = _mm_set1_epi16((short)0x8000);
+	const __m128i maxLanes = _mm_set1_epi32((int)0xFFFF0000);
+	a = _mm_xor_si128(a, bias);
+	b = _mm_xor_si128(b, bias);
+	__m128i r = _mm_or_si128(_mm_andnot_si128(maxLanes, _mm_min_epi16(a, b)), _mm_and_si128(maxLanes, _mm_max_epi16(a, b)));
+	return _mm_xor_si128(r, bias);
+}
+#endif
+
+// conservative height bounds of the terrain surface for any rectangle, kept next to the heightmap for culling,
+// picking and streaming.
+// level 0 has one entry per bilinear cell (the square between samples x..x+1, y..y+1) and every next level halves
+// it like GL mipmaps do, with the last row and column of an odd level folded into their neighbour. entries are
+// (min, max) pairs quantized to 16 bit over the terrain height range, rounded outwards, so the same data uploads
+// straight to an RG16 texture
+class HeightPyramid
+{
+public:
+	bool empty() const
+	{
+		return Levels.empty();
+	}
+
+	int levelCount() const
+	{
+		return (int)Levels.size();
+	}
+
+	// meters = normalized value * x + y, for the texture
+	float rangeScale() const
+	{
+		return Step * 65535.0f;
+	}
+
+	float rangeOffset() const
+	{
+		return Offset;
+	}
+
+	void build(const Heightmap& map, ThreadPool& pool)
+	{
+		Levels.clear();
+		SamplesX = map.Width;
+		SamplesY = map.Height;
+		Offset = map.MinHeight;
+		Step = map.MaxHeight > map.MinHeight ? (map.MaxHeight - map.MinHeight) / 65535.0f : 1.0f;
+
+		Level base;
+		base.Width = std::max(1, map.Width - 1);
+		base.Height = std::max(1, map.Height - 1);
+		base.MinMax.resize((size_t)base.Width * base.Height * 2);
+		// one task per cell row, cell bounds are the min and max of its four corner samples
+		pool.parallelFor(base.Height, [&](size_t y) {
+			std::vector<float> a(map.Width), b(map.Width), lo(base.Width), hi(base.Width);
+			map.rowToMeters((int)y, 0, map.Width, a.data());
+			map.rowToMeters(std::min((int)y + 1, map.Height - 1), 0, map.Width, b.data());
+			int x = 0;
+#ifdef HR_SSE2
+			for (; x + 4 <= base.Width && x + 4 < map.Width; x += 4)
+			{
+				__m128 a0 = _mm_loadu_ps(&a[x]), a1 = _mm_loadu_ps(&a[x + 1]);
+				__m128 b0 = _mm_loadu_ps(&b[x]), b1 = _mm_loadu_ps(&b[x + 1]);
+				_mm_storeu_ps(&lo[x], _mm_min_ps(_mm_min_ps(a0, a1), _mm_min_ps(b0, b1)));
+				_mm_storeu_ps(&hi[x], _mm_max_ps(_mm_max_ps(a0, a1), _mm_max_ps(b0, b1)));
+			}
+#endif
+			for (; x < base.Width; x++)
+			{
+				int x1 = std::min(x + 1, map.Width - 1);
+				lo[x] = std::min(std::min(a[x], a[x1]), std::min(b[x], b[x1]));
+				hi[x] = std::max(std::max(a[x], a[x1]), std::max(b[x], b[x1]));
+			}
+			uint16_t* out = &base.MinMax[y * base.Width * 2];
+			for (x = 0; x < base.Width; x++)
+			{
+				out[x * 2] = quantize(std::floor((lo[x] - Offset) / Step));
+				out[x * 2 + 1] = quantize(std::ceil((hi[x] - Offset) / Step));
+			}
+		});
+		Levels.push_back(std::move(base));
+		reduceLevels(pool);
+	}
+
+	// widens the bounds to lo..hi meters over a rectangle in texture coordinates, with a cell of margin for the
+	// filtering across its edge, and rebuilds the coarser levels. for data finer than the map the pyramid was built
+	// from: the box filtered samples of an overview don't reach the peaks and pits of the levels under them
+	struct Range
+	{
+		float U0, V0, U1, V1;
+		float MinHeight, MaxHeight;
+	};
+
+	void widen(const std::vector<Range>& ranges, ThreadPool& pool)
+	{
+		if (Levels.empty() || ranges.empty())
+			return;
+		Level& base = Levels[0];
+		for (const Range& range : ranges)
+		{
+			int c0x = std::max((int)std::floor(range.U0 * SamplesX - 0.5f) - 1, 0);
+			int c0y = std::max((int)std::floor(range.V0 * SamplesY - 0.5f) - 1, 0);
+			int c1x = std::min((int)std::floor(range.U1 * SamplesX - 0.5f) + 1, base.Width - 1);
+			int c1y = std::min((int)std::floor(range.V1 * SamplesY - 0.5f) + 1, base.Height - 1);
+			uint16_t qlo = quantize(std::floor((range.MinHeight - Offset) / Step));
+			uint16_t qhi = quantize(std::ceil((range.MaxHeight - Offset) / Step));
+			for (int y = c0y; y <= c1y; y++)
+			{
+				uint16_t* row = &base.MinMax[(size_t)y * base.Width * 2];
+				for (int x = c0x; x <= c1x; x++)
+				{
+					row[x * 2] = std::min(row[x * 2], qlo);
+					row[x * 2 + 1] = std::max(row[x * 2 + 1], qhi);
+				}
+			}
+		}
+		Levels.resize(1);
+		reduceLevels(pool);
+	}
+
+	// bounds in meters of the surface over the cells c0..c1 (inclusive) of level 0.
+	// walks up to the first level where the range touches at most 2x2 entries, so the answer is exact for
+	// aligned power of two ranges and at most twice too large per axis otherwise
+	void cellBounds(int c0x, int c0y, int c1x, int c1y, float& lo, float& hi) const
+	{
+		const Level& base = Levels[0];
+		c0x = std::clamp(c0x, 0, base.Width - 1);
+		c1x = std::clamp(c1x, c0x, base.Width - 1);
+		c0y = std::clamp(c0y, 0, base.Height - 1);
+		c1y = std::clamp(c1y, c0y, base.Height - 1);
+		for (int l = 0; l < (int)Levels.size(); l++)
+		{
+			const Level& level = Levels[l];
+			int x0 = std::min(c0x >> l, level.Width - 1), x1 = std::min(c1x >> l, level.Width - 1);
+			int y0 = std::min(c0y >> l, level.Height - 1), y1 = std::min(c1y >> l, level.Height - 1);
+			if (x1 - x0 > 1 || y1 - y0 > 1)
+				continue;
+			uint16_t qlo = 65535, qhi = 0;
+			for (int y = y0; y <= y1; y++)
+			{
+				for (int x = x0; x <= x1; x++)
+				{
+					qlo = std::min(qlo, level.MinMax[((size_t)y * level.Width + x) * 2]);
+					qhi = std::max(qhi, level.MinMax[((size_t)y * level.Width + x) * 2 + 1]);
+				}
+			}
+			lo = qlo * Step + Offset;
+			hi = qhi * Step + Offset;
+			return;
+		}
+	}
+
+	// same for a rectangle in texture coordinates, covering every sample bilinear filtering can blend in there
+	void bounds(float u0, float v0, float u1, float v1, float& lo, float& hi) const
+	{
+		cellBounds((int)std::floor(std::min(u0, u1) * SamplesX - 0.5f), (int)std::floor(std::min(v0, v1) * SamplesY - 0.5f),
+			(int)std::floor(std::max(u0, u1) * SamplesX - 0.5f), (int)std::floor(std::max(v0, v1) * SamplesY - 0.5f), lo, hi);
+	}
+
+	// RG16 with the levels as mipmaps, read with texelFetch
+	GLuint createTexture() const
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexStorage2D(GL_TEXTURE_2D, (GLsizei)Levels.size(), GL_RG16, Levels[0].Width, Levels[0].Height);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		for (size_t l = 0; l < Levels.size(); l++)
+			glTexSubImage2D(GL_TEXTURE_2D, (GLint)l, 0, 0, Levels[l].Width, Levels[l].Height, GL_RG, GL_UNSIGNED_SHORT, Levels[l].MinMax.data());
+		return texture;
+	}
+
+private:
+	struct Level
+	{
+		int Width = 0;
+		int Height = 0;
+		std::vector<uint16_t> MinMax;
+	};
+
+	std::vector<Level> Levels;
+	int SamplesX = 0;
+	int SamplesY = 0;
+	float Offset = 0.0f;
+	float Step = 1.0f;
+
+	static uint16_t quantize(float q)
+	{
+		return (uint16_t)std::clamp(q, 0.0f, 65535.0f);
+	}
+
+	void reduceLevels(ThreadPool& pool)
+	{
+		while (Levels.back().Width > 1 || Levels.back().Height > 1)
+			Levels.push_back(reduce(Levels.back(), pool));
+	}
+
+	// entry (x, y) covers children 2x..2x+1, 2y..2y+1, plus the leftover child of an odd level at the end
+	static Level reduce(const Level& fine, ThreadPool& pool)
+	{
+		Level coarse;
+		coarse.Width = std::max(1, fine.Width / 2);
+		coarse.Height = std::max(1, fine.Height / 2);
+		coarse.MinMax.resize((size_t)coarse.Width * coarse.Height * 2);
+		pool.parallelFor(coarse.Height, [&](size_t y) {
+			// merge the child rows first
+			int first = (int)y * 2;
+			int last = y + 1 == (size_t)coarse.Height ? fine.Height - 1 : first + 1;
+			std::vector<uint16_t> row(fine.MinMax.begin() + (size_t)first * fine.Width * 2, fine.MinMax.begin() + (size_t)(first + 1) * fine.Width * 2);
+			for (int r = first + 1; r <= last; r++)
+				mergeRow(row.data(), &fine.MinMax[(size_t)r * fine.Width * 2], fine.Width);
+
+			// then neighbouring entries along it, two at a time except the last one which may have a third child
+			uint16_t* out = &coarse.MinMax[y * coarse.Width * 2];
+			int x = 0;
+#ifdef HR_SSE2
+			for (; x + 2 < coarse.Width; x += 2)
+			{
+				__m128i v = _mm_loadu_si128((const __m128i*)&row[x * 4]);
+				__m128i m = mergeMinMax16(v, _mm_srli_epi64(v, 32));
+				_mm_storel_epi64((__m128i*)&out[x * 2], _mm_shuffle_epi32(m, _MM_SHUFFLE(3, 1, 2, 0)));
+			}
+#endif
+			for (; x < coarse.Width; x++)
+			{
+				int c0 = std::min(x * 2, fine.Width - 1);
+				int c1 = x + 1 == coarse.Width ? fine.Width - 1 : c0 + 1;
+				uint16_t lo = 65535, hi = 0;
+				for (int c = c0; c <= c1; c++)
+				{
+					lo = std::min(lo, row[c * 2]);
+					hi = std::max(hi, row[c * 2 + 1]);
+				}
+				out[x * 2] = lo;
+				out[x * 2 + 1] = hi;
+			}
+		});
+		return coarse;
+	}
+
+	static void mergeRow(uint16_t* dst, const uint16_t* src, int entries)
+	{
+		int i = 0;
+#ifdef HR_SSE2
+		for (; i + 4 <= entries; i += 4)
+		{
+			__m128i a = _mm_loadu_si128((const __m128i*)&dst[i * 2]);
+			__m128i b = _mm_loadu_si128((const __m128i*)&src[i * 2]);
+			_mm_storeu_si128((__m128i*)&dst[i * 2], mergeMinMax16(a, b));
+		}
+#endif
+		for (; i < entries; i++)
+		{
+			dst[i * 2] = std::min(dst[i * 2], src[i * 2]);
+			dst[i * 2 + 1] = std::max(dst[i * 2 + 1], src[i * 2 + 1]);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,446 @@
+#ifndef HEIGHTMAP_H
+#define HEIGHTMAP_H
+
+#include <cstdint>
+#include <cstring>
+#include <cctype>
+#include <cmath>
+#include <cstdlib>
+#include <limits>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include "stb_image.h"
+#include "simd.h"
+
+// sample formats that can be uploaded as a single channel texture without expanding to RGBA
+enum HeightFormat {
+	HEIGHT_R16,  // unsigned normalized 16 bit, sampled as [0, 1] in the shaders
+	HEIGHT_R32F  // 32 bit float, sampled as is
+};
+
+// single channel heightmap kept at its native precision on the CPU
+// the height in meters of a sample is: sample * Scale + Offset
+struct Heightmap
+{
+	int Width = 0;
+	int Height = 0;
+	HeightFormat Format = HEIGHT_R16;
+	float Scale = 1.0f;
+	float Offset = 0.0f;
+	// lowest and highest height in meters, filled in by the loaders
+	float MinHeight = 0.0f;
+	float MaxHeight = 0.0f;
+
+	std::vector<uint16_t> Data16;
+	std::vector<float> Data32;
+
+	bool empty() const
+	{
+		return Width <= 0 || Height <= 0;
+	}
+
+	// raw sample normalized the same way the GPU sees it
+	float sample(int x, int y) const
+	{
+		size_t i = (size_t)y * Width + x;
+		return Format == HEIGHT_R16 ? Data16[i] / 65535.0f : Data32[i];
+	}
+
+	// height in meters, coordinates are clamped to the map
+	float heightAt(int x, int y) const
+	{
+		x = std::clamp(x, 0, Width - 1);
+		y = std::clamp(y, 0, Height - 1);
+		return sample(x, y) * Scale + Offset;
+	}
+
+	// converts count samples of row y starting at column x0 to meters
+	void rowToMeters(int y, int x0, int count, float* out) const
+	{
+		size_t start = (size_t)y * Width + x0;
+		int x = 0;
+		if (Format == HEIGHT_R32F)
+		{
+			const float* src = &Data32[start];
+#ifdef HR_SSE2
+			__m128 scale = _mm_set1_ps(Scale), offset = _mm_set1_ps(Offset);
+			for (; x + 4 <= count; x += 4)
+				_mm_storeu_ps(out + x, _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(src + x), scale), offset));
+#endif
+			for (; x < count; x++)
+				out[x] = src[x] * Scale + Offset;
+			return;
+		}
+
+		const uint16_t* src = &Data16[start];
+		float scale16 = Scale / 65535.0f;
+#ifdef HR_SSE2
+		__m128 scale = _mm_set1_ps(scale16), offset = _mm_set1_ps(Offset);
+		__m128i zero = _mm_setzero_si128();
+		for (; x + 8 <= count; x += 8)
+		{
+			__m128i s = _mm_loadu_si128((const __m128i*)(src + x));
+			__m128 lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(s, zero));
+			__m128 hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(s, zero));
+			_mm_storeu_ps(out + x, _mm_add_ps(_mm_mul_ps(lo, scale), offset));
+			_mm_storeu_ps(out + x + 4, _mm_add_ps(_mm_mul_ps(hi, scale), offset));
+		}
+#endif
+		for (; x < count; x++)
+			out[x] = src[x] * scale16 + Offset;
+	}
+
+	const void* data() const
+	{
+		return Format == HEIGHT_R16 ? (const void*)Data16.data() : (const void*)Data32.data();
+	}
+
+	size_t bytesPerSample() const
+	{
+		return Format == HEIGHT_R16 ? sizeof(uint16_t) : sizeof(float);
+	}
+
+	void updateRange()
+	{
+		float lo = 0.0f, hi = 0.0f;
+		if (Format == HEIGHT_R16 && !Data16.empty())
+		{
+			auto mm = std::minmax_element(Data16.begin(), Data16.end());
+			lo = *mm.first / 65535.0f;
+			hi = *mm.second / 65535.0f;
+		}
+		else if (Format == HEIGHT_R32F && !Data32.empty())
+		{
+			auto mm = std::minmax_element(Data32.begin(), Data32.end());
+			lo = *mm.first;
+			hi = *mm.second;
+		}
+		// a negative scale flips which end is the lowest
+		MinHeight = std::min(lo * Scale, hi * Scale) + Offset;
+		MaxHeight = std::max(lo * Scale, hi * Scale) + Offset;
+	}
+};
+
+// decodes a PNG (8 or 16 bit) straight to 16 bit samples with stbi_load_16
+// 8 bit images are widened by stb, multi channel images keep only the green channel which is what the shaders used to read
+inline bool loadHeightmapPNG(const char* path, Heightmap& map, float scale, float offset)
+{
+	int width, height, channels;
+	stbi_us* data = stbi_load_16(path, &width, &height, &channels, 0);
+	if (!data)
+	{
+		std::cout << "ERROR::HEIGHTMAP::FAILED_TO_LOAD " << path << ": " << stbi_failure_reason() << std::endl;
+		return false;
+	}
+
+	int channel = channels >= 3 ? 1 : 0;
+	map.Width = width;
+	map.Height = height;
+	map.Format = HEIGHT_R16;
+	map.Scale = scale;
+	map.Offset = offset;
+	map.Data32.clear();
+	map.Data16.resize((size_t)width * height);
+	for (size_t i = 0; i < map.Data16.size(); i++)
+		map.Data16[i] = data[i * channels + channel];
+	stbi_image_free(data);
+
+	map.updateRange();
+	return true;
+}
+
+// reads headerless little endian R16 or R32F samples
+// pass 0 for width and height to take a square map from the file size
+inline bool loadHeightmapRaw(const char* path, HeightFormat format, int width, int height, Heightmap& map, float scale, float offset)
+{
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file)
+	{
+		std::cout << "ERROR::HEIGHTMAP::FAILED_TO_OPEN " << path << std::endl;
+		return false;
+	}
+
+	size_t bytesPerSample = format == HEIGHT_R16 ? sizeof(uint16_t) : sizeof(float);
+	size_t fileSize = (size_t)file.tellg();
+	size_t samples = fileSize / bytesPerSample;
+	if (width <= 0 || height <= 0)
+	{
+		width = height = (int)std::lround(std::sqrt((double)samples));
+	}
+	if ((size_t)width * height != samples || fileSize % bytesPerSample != 0)
+	{
+		std::cout << "ERROR::HEIGHTMAP::RAW_SIZE_MISMATCH " << path << " (" << fileSize << " bytes)" << std::endl;
+		return false;
+	}
+
+	map.Width = width;
+	map.Height = height;
+	map.Format = format;
+	map.Scale = scale;
+	map.Offset = offset;
+	map.Data16.clear();
+	map.Data32.clear();
+
+	file.seekg(0);
+	if (format == HEIGHT_R16)
+	{
+		map.Data16.resize(samples);
+		file.read((char*)map.Data16.data(), fileSize);
+	}
+	else
+	{
+		map.Data32.resize(samples);
+		file.read((char*)map.Data32.data(), fileSize);
+	}
+	if (!file)
+	{
+		std::cout << "ERROR::HEIGHTMAP::READ_FAILED " << path << std::endl;
+		return false;
+	}
+
+	map.updateRange();
+	return true;
+}
+
+// where a map lies in its coordinate system: the south west corner of the first column of the last row, in map units
+struct GeoReference
+{
+	bool Valid = false;
+	double X = 0.0;
+	double Y = 0.0;
+	double CellSize = 1.0;
+};
+
+// header of an ESRI ASCII grid: ncols, nrows, xll*, yll*, cellsize and an optional NODATA_value
+struct AsciiGridHeader
+{
+	int Cols = 0;
+	int Rows = 0;
+	double X = 0.0;
+	double Y = 0.0;
+	double CellSize = 0.0;
+	bool Centered = false;
+	bool HasNoData = false;
+	float NoData = 0.0f;
+
+	// the *center keys give the middle of the south west cell
+	GeoReference geo() const
+	{
+		GeoReference geo;
+		geo.Valid = CellSize > 0.0;
+		geo.CellSize = CellSize;
+		geo.X = Centered ? X - CellSize * 0.5 : X;
+		geo.Y = Centered ? Y - CellSize * 0.5 : Y;
+		return geo;
+	}
+};
+
+// header keys come first, the first line starting with a number is data. p is left at the first value
+inline bool parseAsciiGridHeader(const char*& p, const char* end, AsciiGridHeader& header)
+{
+	for (;;)
+	{
+		while (p < end && std::isspace((unsigned char)*p))
+			p++;
+		if (p >= end || !std::isalpha((unsigned char)*p))
+			break;
+		const char* keyStart = p;
+		while (p < end && !std::isspace((unsigned char)*p))
+			p++;
+		std::string key(keyStart, p);
+		std::transform(key.begin(), key.end(), key.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+		char* valueEnd;
+		double value = std::strtod(p, &valueEnd);
+		p = valueEnd;
+		if (key == "ncols")
+			header.Cols = (int)value;
+		else if (key == "nrows")
+			header.Rows = (int)value;
+		else if (key == "xllcorner" || key == "xllcenter")
+		{
+			header.X = value;
+			header.Centered = key == "xllcenter";
+		}
+		else if (key == "yllcorner" || key == "yllcenter")
+			header.Y = value;
+		else if (key == "cellsize")
+			header.CellSize = value;
+		else if (key == "nodata_value")
+		{
+			header.HasNoData = true;
+			header.NoData = (float)value;
+		}
+	}
+	return header.Cols > 0 && header.Rows > 0;
+}
+
+// reads an ESRI ASCII grid (header, then rows north to south)
+// values are meters and are stored as R32F, nodata cells are set to the lowest valid height
+inline bool loadHeightmapASCII(const char* path, Heightmap& map, GeoReference* geo = nullptr)
+{
+	std::ifstream file(path, std::ios::binary | std::ios::ate);
+	if (!file)
+	{
+		std::cout << "ERROR::HEIGHTMAP::FAILED_TO_OPEN " << path << std::endl;
+		return false;
+	}
+	std::string text((size_t)file.tellg(), '\0');
+	file.seekg(0);
+	file.read(&text[0], text.size());
+
+	const char* p = text.c_str();
+	const char* end = p + text.size();
+	AsciiGridHeader header;
+	if (!parseAsciiGridHeader(p, end, header))
+	{
+		std::cout << "ERROR::HEIGHTMAP::ASCII_GRID_HEADER " << path << std::endl;
+		return false;
+	}
+	if (geo)
+		*geo = header.geo();
+	int cols = header.Cols, rows = header.Rows;
+	bool hasNoData = header.HasNoData;
+	float noData = header.NoData;
+
+	map.Width = cols;
+	map.Height = rows;
+	map.Format = HEIGHT_R32F;
+	map.Scale = 1.0f;
+	map.Offset = 0.0f;
+	map.Data16.clear();
+	map.Data32.resize((size_t)cols * rows);
+
+	float lowest = std::numeric_limits<float>::max();
+	for (size_t i = 0; i < map.Data32.size(); i++)
+	{
+		char* valueEnd;
+		float value = std::strtof(p, &valueEnd);
+		if (valueEnd == p)
+		{
+			std::cout << "ERROR::HEIGHTMAP::ASCII_GRID_TRUNCATED " << path << " after " << i << " values" << std::endl;
+			return false;
+		}
+		p = valueEnd;
+		map.Data32[i] = value;
+		if (!(hasNoData && value == noData))
+			lowest = std::min(lowest, value);
+	}
+	if (hasNoData)
+	{
+		if (lowest == std::numeric_limits<float>::max())
+			lowest = 0.0f;
+		for (float& value : map.Data32)
+			if (value == noData)
+				value = lowest;
+	}
+
+	map.updateRange();
+	return true;
+}
+
+inline std::string heightmapExtension(const std::string& path)
+{
+	size_t dot = path.find_last_of('.');
+	std::string ext = dot == std::string::npos ? "" : path.substr(dot + 1);
+	std::transform(ext.begin(), ext.end(), ext.begin(), [](unsigned char c) { return (char)std::tolower(c); });
+	return ext;
+}
+
+// format loadHeightmap stores the samples of path in
+inline HeightFormat heightmapFormat(const std::string& path)
+{
+	std::string ext = heightmapExtension(path);
+	return ext == "r32" || ext == "f32" || ext == "asc" ? HEIGHT_R32F : HEIGHT_R16;
+}
+
+// size of a map without reading its samples, plus the georeference of .asc grids
+inline bool readHeightmapSize(const char* path, int& width, int& height, GeoReference* geo = nullptr)
+{
+	std::string ext = heightmapExtension(path);
+	if (ext == "r16" || ext == "raw" || ext == "r32" || ext == "f32")
+	{
+		std::ifstream file(path, std::ios::binary | std::ios::ate);
+		if (!file)
+			return false;
+		// square like loadHeightmapRaw
+		size_t bytesPerSample = heightmapFormat(path) == HEIGHT_R16 ? sizeof(uint16_t) : sizeof(float);
+		width = height = (int)std::lround(std::sqrt((double)((size_t)file.tellg() / bytesPerSample)));
+		return width > 0;
+	}
+	if (ext == "asc")
+	{
+		std::ifstream file(path, std::ios::binary);
+		if (!file)
+			return false;
+		// the header is a few short lines
+		std::string text(1024, '\0');
+		file.read(&text[0], text.size());
+		text.resize((size_t)file.gcount());
+		const char* p = text.c_str();
+		AsciiGridHeader header;
+		if (!parseAsciiGridHeader(p, p + text.size(), header))
+			return false;
+		width = header.Cols;
+		height = header.Rows;
+		if (geo)
+			*geo = header.geo();
+		return true;
+	}
+	int channels;
+	return stbi_info(path, &width, &height, &channels) != 0;
+}
+
+// picks the loader from the file extension: .r16/.raw are R16, .r32/.f32 are R32F in meters, .asc is an ESRI ASCII grid,
+// anything else goes through stb
+// scale and offset map the normalized R16 samples to meters, float maps are taken as meters already
+inline bool loadHeightmap(const char* path, Heightmap& map, float scale, float offset)
+{
+	std::string ext = heightmapExtension(path);
+	if (ext == "r16" || ext == "raw")
+		return loadHeightmapRaw(path, HEIGHT_R16, 0, 0, map, scale, offset);
+	if (ext == "r32" || ext == "f32")
+		return loadHeightmapRaw(path, HEIGHT_R32F, 0, 0, map, 1.0f, 0.0f);
+	if (ext == "asc")
+		return loadHeightmapASCII(path, map);
+	return loadHeightmapPNG(path, map, scale, offset);
+}
+
+inline int mipLevelCount(int width, int height)
+{
+	int levels = 1;
+	while ((std::max(width, height) >> levels) > 0)
+		levels++;
+	return levels;
+}
+
+// uploads the heightmap to an immutable GL_R16 / GL_R32F texture with a full mip chain
+// the texture is left bound to GL_TEXTURE_2D on the active texture unit
+inline GLuint createHeightTexture(const Heightmap& map)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	// wrapping params
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	// filtering params
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+
+	bool is16 = map.Format == HEIGHT_R16;
+	glTexStorage2D(GL_TEXTURE_2D, mipLevelCount(map.Width, map.Height), is16 ? GL_R16 : GL_R32F, map.Width, map.Height);
+	// 16 bit rows of odd width are not 4 byte aligned
+	glPixelStorei(GL_UNPACK_ALIGNMENT, is16 ? 2 : 4);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, map.Width, map.Height, GL_RED, is16 ? GL_UNSIGNED_SHORT : GL_FLOAT, map.data());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glGenerateMipmap(GL_TEXTURE_2D);
+
+	return texture;
+}
+
+#endif
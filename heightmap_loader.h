@@ -0,0 +1,432 @@
+#ifndef HEIGHTMAP_LOADER_H
+#define HEIGHTMAP_LOADER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include "heightmap.h"
+#include "terrain_file.h"
+#include "roughness_map.h"
+#include "height_pyramid.h"
+#include "normal_map.h"
+#include "thread_pool.h"
+
+// what the renderer needs to know about a terrain before any samples arrive
+struct TerrainInfo
+{
+	std::string Source;
+	int Width = 0;
+	int Height = 0;
+	int LevelCount = 0;
+	// levels above the size limit are left to the tile streamer, the texture starts at FirstLevel
+	int FirstLevel = 0;
+	int TextureWidth = 0;
+	int TextureHeight = 0;
+	HeightFormat Format = HEIGHT_R16;
+	float Scale = 1.0f;
+	float Offset = 0.0f;
+	float MinHeight = 0.0f;
+	float MaxHeight = 0.0f;
+};
+
+// 2x2 box filter, odd sizes round down like glGenerateMipmap does
+inline Heightmap downsampleHeightmap(const Heightmap& src, ThreadPool& pool)
+{
+	Heightmap dst;
+	dst.Width = std::max(1, src.Width / 2);
+	dst.Height = std::max(1, src.Height / 2);
+	dst.Format = src.Format;
+	dst.Scale = src.Scale;
+	dst.Offset = src.Offset;
+	dst.MinHeight = src.MinHeight;
+	dst.MaxHeight = src.MaxHeight;
+	if (src.Format == HEIGHT_R16)
+		dst.Data16.resize((size_t)dst.Width * dst.Height);
+	else
+		dst.Data32.resize((size_t)dst.Width * dst.Height);
+
+	pool.parallelFor(dst.Height, [&](size_t y) {
+		int y0 = std::min((int)y * 2, src.Height - 1), y1 = std::min((int)y * 2 + 1, src.Height - 1);
+		for (int x = 0; x < dst.Width; x++)
+		{
+			int x0 = std::min(x * 2, src.Width - 1), x1 = std::min(x * 2 + 1, src.Width - 1);
+			size_t a = (size_t)y0 * src.Width + x0, b = (size_t)y0 * src.Width + x1;
+			size_t c = (size_t)y1 * src.Width + x0, d = (size_t)y1 * src.Width + x1;
+			if (src.Format == HEIGHT_R16)
+				dst.Data16[y * dst.Width + x] = (uint16_t)(((uint32_t)src.Data16[a] + src.Data16[b] + src.Data16[c] + src.Data16[d] + 2) / 4);
+			else
+				dst.Data32[y * dst.Width + x] = (src.Data32[a] + src.Data32[b] + src.Data32[c] + src.Data32[d]) * 0.25f;
+		}
+	});
+	return dst;
+}
+
+// reads or decodes the terrain on its own thread and hands it to the GL thread a mip level at a time, coarsest first.
+// a .hrt pyramid is read level by level straight from its tiles, an image has to be decoded completely and is then
+// mipmapped on the CPU. once the finest level is out, the roughness map, min/max pyramid and normals are built from it.
+// for a streamed terrain that is the overview level, so their bounds come from filtered heights there
+class HeightmapLoader
+{
+public:
+	~HeightmapLoader()
+	{
+		Stopping = true;
+		if (Worker.joinable())
+			Worker.join();
+	}
+
+	// levels of a .hrt file with a side over maxSize are skipped, images are always loaded whole
+	void start(const char* terrainPath, const char* imagePath, float scale, float offset, int roughnessCells, int maxSize, ThreadPool& pool)
+	{
+		Start = std::chrono::steady_clock::now();
+		Worker = std::thread([=, &pool] { run(terrainPath, imagePath, scale, offset, roughnessCells, maxSize, pool); });
+	}
+
+	bool failed() const
+	{
+		return Failed;
+	}
+
+	// true once, when the size and format are known
+	bool takeInfo(TerrainInfo& info)
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		if (!HasInfo || InfoTaken)
+			return false;
+		InfoTaken = true;
+		info = Info;
+		return true;
+	}
+
+	bool takeLevel(int& level, std::shared_ptr<const Heightmap>& map)
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		if (Levels.empty())
+			return false;
+		level = Levels.front().first;
+		map = std::move(Levels.front().second);
+		Levels.pop_front();
+		return true;
+	}
+
+	// true once, when heightmap(), roughness(), pyramid() and normals() are filled in
+	bool takeAnalysis()
+	{
+		if (!AnalysisDone || AnalysisTaken)
+			return false;
+		AnalysisTaken = true;
+		return true;
+	}
+
+	const Heightmap& heightmap() const
+	{
+		return *Base;
+	}
+
+	const RoughnessMap& roughness() const
+	{
+		return Roughness;
+	}
+
+	const HeightPyramid& pyramid() const
+	{
+		return Pyramid;
+	}
+
+	const NormalMap& normals() const
+	{
+		return Normals;
+	}
+
+	double secondsSinceStart() const
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now() - Start).count();
+	}
+
+private:
+	std::thread Worker;
+	std::mutex Mutex;
+	std::atomic<bool> Stopping{ false };
+	std::atomic<bool> Failed{ false };
+	std::atomic<bool> AnalysisDone{ false };
+	bool AnalysisTaken = false;
+	std::chrono::steady_clock::time_point Start;
+
+	TerrainInfo Info;
+	bool HasInfo = false;
+	bool InfoTaken = false;
+	std::deque<std::pair<int, std::shared_ptr<const Heightmap>>> Levels;
+
+	std::shared_ptr<const Heightmap> Base;
+	RoughnessMap Roughness;
+	HeightPyramid Pyramid;
+	NormalMap Normals;
+
+	void publishInfo(const TerrainInfo& info)
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		Info = info;
+		HasInfo = true;
+	}
+
+	void publishLevel(int level, std::shared_ptr<const Heightmap> map)
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		Levels.emplace_back(level, std::move(map));
+	}
+
+	void run(const char* terrainPath, const char* imagePath, float scale, float offset, int roughnessCells, int maxSize, ThreadPool& pool)
+	{
+		TerrainFile terrainFile;
+		if (terrainFile.open(terrainPath))
+		{
+			const TerrainFileHeader& header = terrainFile.header();
+			TerrainInfo info;
+			info.Source = terrainPath;
+			info.Width = header.Width;
+			info.Height = header.Height;
+			info.LevelCount = terrainFile.levelCount();
+			while (info.FirstLevel + 1 < info.LevelCount && (int)std::max(terrainFile.level(info.FirstLevel).Width, terrainFile.level(info.FirstLevel).Height) > maxSize)
+				info.FirstLevel++;
+			info.TextureWidth = terrainFile.level(info.FirstLevel).Width;
+			info.TextureHeight = terrainFile.level(info.FirstLevel).Height;
+			info.Format = terrainFile.format();
+			info.Scale = header.Scale;
+			info.Offset = header.Offset;
+			info.MinHeight = header.MinHeight;
+			info.MaxHeight = header.MaxHeight;
+			publishInfo(info);
+
+			// the tiles of the small levels sit next to each other in the file, so the first ones come in right away
+			// texture levels are counted from FirstLevel
+			for (int l = info.LevelCount - 1; l >= info.FirstLevel && !Stopping; l--)
+			{
+				auto level = std::make_shared<Heightmap>();
+				terrainFile.readLevel(l, *level);
+				if (l == info.FirstLevel)
+					Base = level;
+				publishLevel(l - info.FirstLevel, std::move(level));
+			}
+		}
+		else
+		{
+			auto base = std::make_shared<Heightmap>();
+			if (!loadHeightmap(imagePath, *base, scale, offset))
+			{
+				std::cout << "Failed to load" << std::endl;
+				Failed = true;
+				return;
+			}
+			TerrainInfo info;
+			info.Source = imagePath;
+			info.Width = base->Width;
+			info.Height = base->Height;
+			info.LevelCount = mipLevelCount(base->Width, base->Height);
+			info.TextureWidth = base->Width;
+			info.TextureHeight = base->Height;
+			info.Format = base->Format;
+			info.Scale = base->Scale;
+			info.Offset = base->Offset;
+			info.MinHeight = base->MinHeight;
+			info.MaxHeight = base->MaxHeight;
+			publishInfo(info);
+
+			// the whole chain is needed before the coarsest level exists, it is a fraction of the decode time though
+			std::vector<std::shared_ptr<const Heightmap>> chain = { base };
+			for (int l = 1; l < info.LevelCount && !Stopping; l++)
+				chain.push_back(std::make_shared<Heightmap>(downsampleHeightmap(*chain.back(), pool)));
+			for (int l = (int)chain.size() - 1; l >= 0; l--)
+				publishLevel(l, chain[l]);
+			Base = base;
+		}
+
+		if (Stopping || !Base)
+			return;
+		Roughness = buildRoughnessMap(*Base, roughnessCells, pool);
+		Pyramid.build(*Base, pool);
+		if (Info.FirstLevel > 0)
+		{
+			// the overview is box filtered, the exact extremes of the full resolution tiles keep the bounds
+			// conservative for the streamed levels
+			const TerrainFileHeader& header = terrainFile.header();
+			const TerrainLevel& finest = terrainFile.level(0);
+			std::vector<HeightPyramid::Range> ranges;
+			ranges.reserve((size_t)finest.TilesX * finest.TilesY);
+			for (uint32_t ty = 0; ty < finest.TilesY; ty++)
+			{
+				for (uint32_t tx = 0; tx < finest.TilesX; tx++)
+				{
+					const TerrainTile& tile = terrainFile.tile(0, tx, ty);
+					uint32_t x0 = tx * header.TileSize, y0 = ty * header.TileSize;
+					uint32_t x1 = std::min(x0 + header.TileSize, finest.Width), y1 = std::min(y0 + header.TileSize, finest.Height);
+					ranges.push_back({ (float)x0 / finest.Width, (float)y0 / finest.Height, (float)x1 / finest.Width, (float)y1 / finest.Height,
+						tile.MinHeight, tile.MaxHeight });
+				}
+			}
+			Pyramid.widen(ranges, pool);
+		}
+		// the base of a streamed terrain is a coarser level, its samples are further apart than one unit
+		Normals = buildNormalMap(*Base, (float)Info.Width / Base->Width, (float)Info.Height / Base->Height, pool);
+		AnalysisDone = true;
+	}
+};
+
+// uploads mip levels into an immutable texture through a ring of pixel buffer objects.
+// levels are copied a band of rows at a time within a per frame byte budget, and a buffer is only refilled once
+// the fence after its last upload has passed. GL_TEXTURE_BASE_LEVEL follows the finest complete level, so the
+// shaders never sample a level that is still missing
+class HeightUploader
+{
+public:
+	static const int BUFFERS = 3;
+	// bytes copied per frame, big levels take several frames
+	size_t FrameBudget = (size_t)16 << 20;
+
+	void init(GLuint texture, int levelCount)
+	{
+		Texture = texture;
+		LevelCount = levelCount;
+		Resident = levelCount;
+		glGenBuffers(BUFFERS, Buffers);
+	}
+
+	void destroy()
+	{
+		for (int i = 0; i < BUFFERS; i++)
+			if (Fences[i])
+				glDeleteSync(Fences[i]);
+		glDeleteBuffers(BUFFERS, Buffers);
+	}
+
+	void push(int level, std::shared_ptr<const Heightmap> map)
+	{
+		Queue.push_back({ level, std::move(map), 0 });
+	}
+
+	bool busy() const
+	{
+		return !Queue.empty();
+	}
+
+	// true once at least one level can be sampled
+	bool ready() const
+	{
+		return Resident < LevelCount;
+	}
+
+	// finest level that can be sampled, LevelCount while there is none
+	int residentLevel() const
+	{
+		return Resident;
+	}
+
+	// returns true when a level was completed
+	bool update()
+	{
+		size_t budget = FrameBudget;
+		bool completed = false;
+		glActiveTexture(GL_TEXTURE0);
+		glBindTexture(GL_TEXTURE_2D, Texture);
+		while (!Queue.empty() && budget > 0)
+		{
+			if (Fences[Next])
+			{
+				GLenum status = glClientWaitSync(Fences[Next], 0, 0);
+				if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+					break;
+				glDeleteSync(Fences[Next]);
+				Fences[Next] = 0;
+			}
+
+			Pending& pending = Queue.front();
+			const Heightmap& map = *pending.Map;
+			bool is16 = map.Format == HEIGHT_R16;
+			size_t rowBytes = (size_t)map.Width * map.bytesPerSample();
+			int rows = (int)std::clamp(budget / rowBytes, (size_t)1, (size_t)(map.Height - pending.NextRow));
+			size_t bytes = rows * rowBytes;
+
+			glBindBuffer(GL_PIXEL_UNPACK_BUFFER, Buffers[Next]);
+			if (Sizes[Next] < bytes)
+			{
+				glBufferData(GL_PIXEL_UNPACK_BUFFER, bytes, nullptr, GL_STREAM_DRAW);
+				Sizes[Next] = bytes;
+			}
+			void* dst = glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, bytes, GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_RANGE_BIT);
+			if (!dst)
+			{
+				std::cout << "ERROR::UPLOADER::MAP_FAILED" << std::endl;
+				break;
+			}
+			memcpy(dst, (const unsigned char*)map.data() + pending.NextRow * rowBytes, bytes);
+			glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+			// 16 bit rows of odd width are not 4 byte aligned
+			glPixelStorei(GL_UNPACK_ALIGNMENT, is16 ? 2 : 4);
+			glTexSubImage2D(GL_TEXTURE_2D, pending.Level, 0, pending.NextRow, map.Width, rows, GL_RED, is16 ? GL_UNSIGNED_SHORT : GL_FLOAT, (void*)0);
+			Fences[Next] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+			Next = (Next + 1) % BUFFERS;
+
+			budget -= std::min(budget, bytes);
+			pending.NextRow += rows;
+			if (pending.NextRow == map.Height)
+			{
+				// draws after this point already see the data, the fence is only for reusing the buffer
+				if (pending.Level < Resident)
+				{
+					Resident = pending.Level;
+					glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, Resident);
+				}
+				Queue.pop_front();
+				completed = true;
+			}
+		}
+		glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		return completed;
+	}
+
+private:
+	struct Pending
+	{
+		int Level;
+		std::shared_ptr<const Heightmap> Map;
+		int NextRow;
+	};
+
+	GLuint Texture = 0;
+	int LevelCount = 0;
+	int Resident = 0;
+	std::deque<Pending> Queue;
+	GLuint Buffers[BUFFERS] = {};
+	GLsync Fences[BUFFERS] = {};
+	size_t Sizes[BUFFERS] = {};
+	int Next = 0;
+};
+
+// immutable storage for all levels with nothing uploaded yet, sampled like createHeightTexture
+inline GLuint createHeightStorage(const TerrainInfo& info)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	int levels = info.LevelCount - info.FirstLevel;
+	glTexStorage2D(GL_TEXTURE_2D, levels, info.Format == HEIGHT_R16 ? GL_R16 : GL_R32F, info.TextureWidth, info.TextureHeight);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, levels - 1);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levels - 1);
+	return texture;
+}
+
+#endif
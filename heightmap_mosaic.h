@@ -0,0 +1,407 @@
+#ifndef HEIGHTMAP_MOSAIC_H
+#define HEIGHTMAP_MOSAIC_H
+
+#include <atomic>
+#include <cmath>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "heightmap.h"
+#include "normal_map.h"
+#include "thread_pool.h"
+
+// one sheet of a mosaic, placed on a sample grid shared by all sheets
+struct MosaicSheet
+{
+	std::string Path;
+	GeoReference Geo;
+	// first sample on the mosaic grid, columns run east and rows south
+	int GridX = 0;
+	int GridY = 0;
+	// cells covered by the sheet, the map has one more sample per side taken from the east and south neighbours
+	// so both sides of a seam interpolate between the same samples
+	int Cells = 0;
+	int Rows = 0;
+	Heightmap Map;
+	// same samples as the map, built over a one sample apron from the neighbours so the seams light the same on both
+	// sides. only the outer edge of the mosaic is clamped
+	NormalMap Normals;
+	// model space xz, the mosaic is centred at the origin like a single map
+	glm::vec2 Center = glm::vec2(0.0f);
+	GLuint Texture = 0;
+	GLuint NormalTexture = 0;
+};
+
+// reads the sheet list of a mosaic: either a directory, taking every .asc grid in it with the georeference of its
+// header, or an index file with a line "path x y cellsize" per sheet (x, y the south west corner in map units).
+// index lines with only a path take the georeference from the file, which only .asc grids have
+inline bool readMosaicIndex(const std::string& path, std::vector<MosaicSheet>& sheets)
+{
+	namespace fs = std::filesystem;
+	std::error_code error;
+	sheets.clear();
+	if (fs::is_directory(path, error))
+	{
+		for (const fs::directory_entry& entry : fs::directory_iterator(path, error))
+		{
+			if (!entry.is_regular_file() || heightmapExtension(entry.path().string()) != "asc")
+				continue;
+			MosaicSheet sheet;
+			sheet.Path = entry.path().string();
+			sheets.push_back(sheet);
+		}
+		// directory order is unspecified, keep runs reproducible
+		std::sort(sheets.begin(), sheets.end(), [](const MosaicSheet& a, const MosaicSheet& b) { return a.Path < b.Path; });
+		return !sheets.empty();
+	}
+
+	std::ifstream file(path);
+	if (!file)
+		return false;
+	fs::path base = fs::path(path).parent_path();
+	std::string line;
+	while (std::getline(file, line))
+	{
+		std::istringstream fields(line);
+		std::string name;
+		if (!(fields >> name) || name[0] == '#')
+			continue;
+		MosaicSheet sheet;
+		sheet.Path = (base / name).string();
+		if (fields >> sheet.Geo.X >> sheet.Geo.Y >> sheet.Geo.CellSize)
+			sheet.Geo.Valid = sheet.Geo.CellSize > 0.0;
+		sheets.push_back(sheet);
+	}
+	return !sheets.empty();
+}
+
+// converts to R32F meters in place
+inline void heightmapToMeters(Heightmap& map)
+{
+	if (map.Format == HEIGHT_R32F && map.Scale == 1.0f && map.Offset == 0.0f)
+		return;
+	std::vector<float> meters((size_t)map.Width * map.Height);
+	for (int y = 0; y < map.Height; y++)
+		map.rowToMeters(y, 0, map.Width, &meters[(size_t)y * map.Width]);
+	map.Data16.clear();
+	map.Data32.swap(meters);
+	map.Format = HEIGHT_R32F;
+	map.Scale = 1.0f;
+	map.Offset = 0.0f;
+}
+
+// width x height samples of a map from (x, y) on, same format
+inline Heightmap cropHeightmap(const Heightmap& map, int x, int y, int width, int height)
+{
+	Heightmap crop;
+	crop.Width = width;
+	crop.Height = height;
+	crop.Format = map.Format;
+	crop.Scale = map.Scale;
+	crop.Offset = map.Offset;
+	if (map.Format == HEIGHT_R16)
+		crop.Data16.resize((size_t)width * height);
+	else
+		crop.Data32.resize((size_t)width * height);
+	size_t bps = map.bytesPerSample();
+	for (int row = 0; row < height; row++)
+		memcpy((unsigned char*)crop.data() + (size_t)row * width * bps, (const unsigned char*)map.data() + ((size_t)(y + row) * map.Width + x) * bps, width * bps);
+	crop.updateRange();
+	return crop;
+}
+
+inline NormalMap cropNormalMap(const NormalMap& normals, int x, int y, int width, int height)
+{
+	NormalMap crop;
+	crop.Width = width;
+	crop.Height = height;
+	crop.Data.resize((size_t)width * height * 2);
+	for (int row = 0; row < height; row++)
+		memcpy(&crop.Data[(size_t)row * width * 2], &normals.Data[((size_t)(y + row) * normals.Width + x) * 2], width * 2);
+	return crop;
+}
+
+// loads a mosaic on its own thread, every sheet on the pool in parallel. the sheets are snapped onto one sample grid
+// (the cell size of the first sheet) from their headers, get the shared border samples and the normals from their
+// neighbours and are handed to the GL thread as soon as they and their neighbours are loaded, which uploads a few
+// per frame
+class MosaicLoader
+{
+public:
+	// mosaic size in cells, valid once the first sheet was handed out
+	int Width = 0;
+	int Height = 0;
+
+	~MosaicLoader()
+	{
+		Stopping = true;
+		if (Worker.joinable())
+			Worker.join();
+	}
+
+	void start(const std::string& path, float scale, float offset, ThreadPool& pool)
+	{
+		Worker = std::thread([=, &pool] { run(path, scale, offset, pool); });
+	}
+
+	bool done() const
+	{
+		return Done;
+	}
+
+	bool failed() const
+	{
+		return Failed;
+	}
+
+	// sheets published but not taken yet
+	bool pending()
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		return Next < Published;
+	}
+
+	bool takeSheet(MosaicSheet& sheet)
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		if (Next >= Published)
+			return false;
+		sheet = std::move(Sheets[Next++]);
+		return true;
+	}
+
+	// height range in meters of the sheets published so far
+	glm::vec2 heightRange()
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		return glm::vec2(MinHeight, MaxHeight);
+	}
+
+private:
+	std::thread Worker;
+	std::mutex Mutex;
+	std::atomic<bool> Stopping{ false };
+	std::atomic<bool> Done{ false };
+	std::atomic<bool> Failed{ false };
+	std::vector<MosaicSheet> Sheets;
+	size_t Published = 0;
+	size_t Next = 0;
+	float MinHeight = 0.0f;
+	float MaxHeight = 0.0f;
+
+	// sheet holding mosaic sample (gx, gy) among the candidates, or nullptr
+	static const MosaicSheet* sheetAt(const std::vector<const MosaicSheet*>& candidates, int gx, int gy)
+	{
+		for (const MosaicSheet* sheet : candidates)
+			if (gx >= sheet->GridX && gx < sheet->GridX + sheet->Cells && gy >= sheet->GridY && gy < sheet->GridY + sheet->Rows)
+				return sheet;
+		return nullptr;
+	}
+
+	// the sheet with a one sample apron on each side from the loaded sheets nearby, one past the shared east and south
+	// samples, so the normals of the samples on a seam see the same neighbours from both sheets. the outer edge of
+	// the mosaic repeats its last samples, holes inside it the sheet's own. the result keeps the interior plus the
+	// shared samples
+	MosaicSheet stitch(const MosaicSheet& sheet, const std::vector<const MosaicSheet*>& nearby, ThreadPool& pool) const
+	{
+		const Heightmap& src = sheet.Map;
+		Heightmap aproned;
+		aproned.Width = src.Width + 3;
+		aproned.Height = src.Height + 3;
+		aproned.Format = src.Format;
+		aproned.Scale = src.Scale;
+		aproned.Offset = src.Offset;
+		if (src.Format == HEIGHT_R16)
+			aproned.Data16.resize((size_t)aproned.Width * aproned.Height);
+		else
+			aproned.Data32.resize((size_t)aproned.Width * aproned.Height);
+		size_t bps = src.bytesPerSample();
+		for (int y = 0; y < aproned.Height; y++)
+		{
+			unsigned char* row = (unsigned char*)aproned.data() + (size_t)y * aproned.Width * bps;
+			bool inside = y >= 1 && y <= src.Height;
+			if (inside)
+				memcpy(row + bps, (const unsigned char*)src.data() + (size_t)(y - 1) * src.Width * bps, src.Width * bps);
+			for (int x = 0; x < aproned.Width; x++)
+			{
+				// the sheet's own row was copied above
+				if (inside && x == 1)
+					x += src.Width;
+				int gx = std::clamp(sheet.GridX + x - 1, 0, Width - 1), gy = std::clamp(sheet.GridY + y - 1, 0, Height - 1);
+				const MosaicSheet* owner = sheetAt(nearby, gx, gy);
+				const Heightmap& from = owner ? owner->Map : src;
+				int fx = owner ? gx - owner->GridX : std::clamp(x - 1, 0, src.Width - 1);
+				int fy = owner ? gy - owner->GridY : std::clamp(y - 1, 0, src.Height - 1);
+				memcpy(row + x * bps, (const unsigned char*)from.data() + ((size_t)fy * from.Width + fx) * bps, bps);
+			}
+		}
+
+		MosaicSheet stitched;
+		stitched.Path = sheet.Path;
+		stitched.Geo = sheet.Geo;
+		stitched.GridX = sheet.GridX;
+		stitched.GridY = sheet.GridY;
+		stitched.Cells = sheet.Cells;
+		stitched.Rows = sheet.Rows;
+		stitched.Center = sheet.Center;
+		stitched.Normals = cropNormalMap(buildNormalMap(aproned, 1.0f, 1.0f, pool), 1, 1, sheet.Cells + 1, sheet.Rows + 1);
+		stitched.Map = cropHeightmap(aproned, 1, 1, sheet.Cells + 1, sheet.Rows + 1);
+		return stitched;
+	}
+
+	void publish(MosaicSheet&& sheet)
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		MinHeight = Published ? std::min(MinHeight, sheet.Map.MinHeight) : sheet.Map.MinHeight;
+		MaxHeight = Published ? std::max(MaxHeight, sheet.Map.MaxHeight) : sheet.Map.MaxHeight;
+		Sheets.push_back(std::move(sheet));
+		Published = Sheets.size();
+	}
+
+	void run(std::string path, float scale, float offset, ThreadPool& pool)
+	{
+		std::vector<MosaicSheet> sheets;
+		if (!readMosaicIndex(path, sheets))
+		{
+			std::cout << "ERROR::MOSAIC::NO_SHEETS " << path << std::endl;
+			Failed = true;
+			return;
+		}
+
+		// the layout only needs the sizes, so it is known before any samples are read
+		std::vector<char> found(sheets.size(), 0);
+		pool.parallelFor(sheets.size(), [&](size_t i) {
+			MosaicSheet& sheet = sheets[i];
+			GeoReference geo;
+			bool ok = readHeightmapSize(sheet.Path.c_str(), sheet.Cells, sheet.Rows, &geo);
+			if (!ok)
+				std::cout << "ERROR::MOSAIC::FAILED_TO_OPEN " << sheet.Path << std::endl;
+			if (!sheet.Geo.Valid)
+				sheet.Geo = geo;
+			if (ok && !sheet.Geo.Valid)
+				std::cout << "ERROR::MOSAIC::NOT_GEOREFERENCED " << sheet.Path << std::endl;
+			found[i] = ok && sheet.Geo.Valid;
+		});
+		size_t kept = 0;
+		for (size_t i = 0; i < sheets.size(); i++)
+		{
+			if (!found[i])
+				continue;
+			if (kept != i)
+				sheets[kept] = std::move(sheets[i]);
+			kept++;
+		}
+		sheets.resize(kept);
+		if (sheets.empty() || Stopping)
+		{
+			Failed = !Stopping;
+			return;
+		}
+
+		// snap onto the grid of the first sheet, north west corner first
+		double cell = sheets[0].Geo.CellSize;
+		double west = sheets[0].Geo.X, north = sheets[0].Geo.Y + sheets[0].Rows * cell;
+		for (const MosaicSheet& sheet : sheets)
+		{
+			west = std::min(west, sheet.Geo.X);
+			north = std::max(north, sheet.Geo.Y + sheet.Rows * sheet.Geo.CellSize);
+		}
+		bool sameFormat = true;
+		for (MosaicSheet& sheet : sheets)
+		{
+			if (std::abs(sheet.Geo.CellSize - cell) > cell * 1e-6)
+				std::cout << "ERROR::MOSAIC::CELL_SIZE " << sheet.Path << ": " << sheet.Geo.CellSize << " instead of " << cell << std::endl;
+			sheet.GridX = (int)std::lround((sheet.Geo.X - west) / cell);
+			sheet.GridY = (int)std::lround((north - (sheet.Geo.Y + sheet.Rows * sheet.Geo.CellSize)) / cell);
+			Width = std::max(Width, sheet.GridX + sheet.Cells);
+			Height = std::max(Height, sheet.GridY + sheet.Rows);
+			sameFormat &= heightmapFormat(sheet.Path) == heightmapFormat(sheets[0].Path);
+		}
+		for (MosaicSheet& sheet : sheets)
+			sheet.Center = glm::vec2(sheet.GridX + sheet.Cells * 0.5f - Width * 0.5f, sheet.GridY + sheet.Rows * 0.5f - Height * 0.5f);
+
+		// the sheets holding samples of each sheet's apron, itself included, and the other way around
+		size_t count = sheets.size();
+		std::vector<std::vector<size_t>> nearby(count), nearbyOf(count);
+		for (size_t i = 0; i < count; i++)
+			for (size_t j = 0; j < count; j++)
+			{
+				const MosaicSheet& sheet = sheets[i];
+				const MosaicSheet& other = sheets[j];
+				if (other.GridX <= sheet.GridX + sheet.Cells + 1 && other.GridX + other.Cells >= sheet.GridX
+					&& other.GridY <= sheet.GridY + sheet.Rows + 1 && other.GridY + other.Rows >= sheet.GridY)
+				{
+					nearby[i].push_back(j);
+					nearbyOf[j].push_back(i);
+				}
+			}
+
+		// a sheet is stitched by whichever load settles the last sheet nearby, and its samples are dropped once every
+		// sheet reading them was stitched or failed
+		std::unique_ptr<std::atomic<bool>[]> loaded(new std::atomic<bool>[count]);
+		std::unique_ptr<std::atomic<size_t>[]> unsettled(new std::atomic<size_t>[count]);
+		std::unique_ptr<std::atomic<size_t>[]> readers(new std::atomic<size_t>[count]);
+		for (size_t i = 0; i < count; i++)
+		{
+			loaded[i] = false;
+			unsettled[i] = nearby[i].size();
+			readers[i] = nearbyOf[i].size();
+		}
+		auto release = [&](size_t i) {
+			for (size_t j : nearby[i])
+				if (--readers[j] == 0)
+				{
+					sheets[j].Map.Data16 = std::vector<uint16_t>();
+					sheets[j].Map.Data32 = std::vector<float>();
+				}
+		};
+		pool.parallelFor(count, [&](size_t i) {
+			MosaicSheet& sheet = sheets[i];
+			bool ok = !Stopping && (heightmapExtension(sheet.Path) == "asc"
+				? loadHeightmapASCII(sheet.Path.c_str(), sheet.Map)
+				: loadHeightmap(sheet.Path.c_str(), sheet.Map, scale, offset));
+			if (ok && (sheet.Map.Width != sheet.Cells || sheet.Map.Height != sheet.Rows))
+			{
+				std::cout << "ERROR::MOSAIC::SIZE_CHANGED " << sheet.Path << std::endl;
+				ok = false;
+			}
+			// border samples are copied raw, so mixed sheets all go to meters
+			if (ok && !sameFormat)
+				heightmapToMeters(sheet.Map);
+			loaded[i] = ok;
+			if (!ok)
+				release(i);
+
+			for (size_t j : nearbyOf[i])
+			{
+				if (--unsettled[j] != 0 || !loaded[j])
+					continue;
+				if (!Stopping)
+				{
+					std::vector<const MosaicSheet*> candidates;
+					for (size_t k : nearby[j])
+						if (loaded[k])
+							candidates.push_back(&sheets[k]);
+					publish(stitch(sheets[j], candidates, pool));
+				}
+				release(j);
+			}
+		});
+
+		std::lock_guard<std::mutex> lock(Mutex);
+		Failed = Published == 0 && !Stopping;
+		Done = true;
+	}
+};
+
+#endif
@@ -0,0 +1,120 @@
+#ifndef HIZ_PYRAMID_H
+#define HIZ_PYRAMID_H
+
+#include <algorithm>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "Shader.h"
+#include "heightmap.h"
+
+// texture units of the pyramid, sampled by the TCS, and of the depth copy it is built from
+const int HIZ_UNIT = 7;
+const int HIZ_DEPTH_UNIT = 8;
+
+// farthest depth per texel of the last frame, halved level by level like GL mipmaps (odd sizes fold the last row and
+// column into their neighbour). the TCS projects a patch's bounds with the matrix of that frame and drops the patch
+// when its nearest point lies behind everything the pyramid holds over its rectangle, so occluders from the last
+// frame hide patches of this one. a patch revealed by the camera move can miss one frame
+class HiZPyramid
+{
+public:
+	bool valid() const
+	{
+		return Valid;
+	}
+
+	GLuint texture() const
+	{
+		return Pyramid;
+	}
+
+	// projection * view * model the pyramid was built with
+	const glm::mat4& viewProjection() const
+	{
+		return ViewProjection;
+	}
+
+	void destroy()
+	{
+		glDeleteTextures(1, &DepthTexture);
+		glDeleteTextures(1, &Pyramid);
+		DepthTexture = Pyramid = 0;
+		Valid = false;
+	}
+
+	// next frame's test ignores the pyramid, for frames that didn't draw the terrain
+	void invalidate()
+	{
+		Valid = false;
+	}
+
+	// copies the depth buffer of the read framebuffer and reduces it, call right after the terrain is drawn
+	void build(Shader& shader, int width, int height, const glm::mat4& viewProjection)
+	{
+		if (width <= 0 || height <= 0)
+			return;
+		if (width != Width || height != Height)
+			resize(width, height);
+
+		glActiveTexture(GL_TEXTURE0 + HIZ_DEPTH_UNIT);
+		glBindTexture(GL_TEXTURE_2D, DepthTexture);
+		glCopyTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, 0, 0, width, height);
+
+		shader.use();
+		shader.setInt("depthTexture", HIZ_DEPTH_UNIT);
+		for (int l = 0; l < Levels; l++)
+		{
+			int w = std::max(1, width >> l), h = std::max(1, height >> l);
+			shader.setInt("hizPass", l == 0 ? 0 : 1);
+			if (l > 0)
+				glBindImageTexture(0, Pyramid, l - 1, GL_FALSE, 0, GL_READ_ONLY, GL_R32F);
+			glBindImageTexture(1, Pyramid, l, GL_FALSE, 0, GL_WRITE_ONLY, GL_R32F);
+			glDispatchCompute((w + 7) / 8, (h + 7) / 8, 1);
+			glMemoryBarrier(GL_SHADER_IMAGE_ACCESS_BARRIER_BIT);
+		}
+		glMemoryBarrier(GL_TEXTURE_FETCH_BARRIER_BIT);
+
+		glActiveTexture(GL_TEXTURE0 + HIZ_UNIT);
+		glBindTexture(GL_TEXTURE_2D, Pyramid);
+		glActiveTexture(GL_TEXTURE0);
+		ViewProjection = viewProjection;
+		Valid = true;
+	}
+
+private:
+	GLuint DepthTexture = 0;
+	GLuint Pyramid = 0;
+	int Width = 0;
+	int Height = 0;
+	int Levels = 0;
+	bool Valid = false;
+	glm::mat4 ViewProjection = glm::mat4(1.0f);
+
+	void resize(int width, int height)
+	{
+		destroy();
+		Width = width;
+		Height = height;
+		Levels = mipLevelCount(width, height);
+
+		glActiveTexture(GL_TEXTURE0 + HIZ_DEPTH_UNIT);
+		glGenTextures(1, &DepthTexture);
+		glBindTexture(GL_TEXTURE_2D, DepthTexture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, width, height);
+
+		glActiveTexture(GL_TEXTURE0 + HIZ_UNIT);
+		glGenTextures(1, &Pyramid);
+		glBindTexture(GL_TEXTURE_2D, Pyramid);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexStorage2D(GL_TEXTURE_2D, Levels, GL_R32F, width, height);
+		glActiveTexture(GL_TEXTURE0);
+	}
+};
+
+#endif
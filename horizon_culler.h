@@ -0,0 +1,618 @@
+#ifndef HORIZON_CULLER_H
+#define HORIZON_CULLER_H
+
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "height_pyramid.h"
+#include "simd.h"
+
+// azimuth bins of the horizon, all around the camera so pitch and field of view don't matter. a power of two,
+// bins wrap around with a mask
+const int HORIZON_CULL_BINS = 2048;
+// rings of cells walked before they double in size, the levels after the first walk their rings RINGS + 1 to about
+// 2 RINGS + 1. a cell there spans 1/RINGS to 1/(2 RINGS) radian, a few bins
+const int HORIZON_CULL_RINGS = 32;
+
+// occlusion culling of the rez x rez patch grid on the CPU, for low flights where the nearest ridges hide most of
+// the terrain. patches are walked front to back in square rings around the camera's patch while a horizon of the
+// steepest guaranteed slope (height above the eye over distance) is kept per azimuth bin. a patch whose highest
+// point stays under the horizon in every bin it covers is hidden.
+// a ray from the camera never goes back to an inner ring, so every patch of the rings inside a patch lies in front
+// of it along the rays they share. a ring is tested against the horizon first and then added to it.
+// far patches cover few bins each, so past HORIZON_CULL_RINGS rings the walk goes on in cells of 2x2 patches from
+// the bounds of the patches in them, then 4x4 and so on. each level starts on the ring after the square of the
+// level before, which is made of whole cells of it, so the order still holds.
+// runs on its own thread between start() and finish(), so the frame can do other work meanwhile.
+// known limit: this misses the budget of well under 1 ms. a moving camera costs 0.9 to 1.2 ms on average at rez 256
+// (1.1 to 1.3 ms at 316) on a single core, with single frames up to a few ms. frames where the camera only turned
+// reuse the last runs, and the bounds are built by prepare() outside of the cull (about 5 ms at rez 256)
+class HorizonCuller
+{
+public:
+	// from the last finish()
+	int Patches = 0;
+	int Hidden = 0;
+	double Milliseconds = 0.0;
+
+	~HorizonCuller()
+	{
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Stopping = true;
+		}
+		Wake.notify_all();
+		if (Worker.joinable())
+			Worker.join();
+	}
+
+	// the cell bounds of a grid, on the calling thread, so the cull itself only walks. called when the pyramid is
+	// handed over and whenever rez changes, start() with a grid that wasn't prepared hides nothing
+	void prepare(const HeightPyramid& pyramid, int rez)
+	{
+		finish();
+		buildLevels(pyramid, rez);
+		BoundsPyramid = &pyramid;
+		BoundsRez = rez;
+	}
+
+	// the pyramid has to outlive the culler
+	void start(const HeightPyramid& pyramid, int rez, glm::vec2 terrainSize, const glm::vec3& camera)
+	{
+		if (!Worker.joinable())
+			Worker = std::thread([this] { run(); });
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Pyramid = &pyramid;
+			Rez = rez;
+			TerrainSize = terrainSize;
+			Camera = camera;
+			Pending = true;
+		}
+		Wake.notify_one();
+	}
+
+	// waits for the job from start(). the visible patches come out as runs of consecutive patch indices, in
+	// patch grid order (column outer, row inner)
+	void finish()
+	{
+		std::unique_lock<std::mutex> lock(Mutex);
+		Done.wait(lock, [this] { return !Pending; });
+	}
+
+	const std::vector<GLint>& runFirst() const
+	{
+		return RunFirst;
+	}
+
+	const std::vector<GLsizei>& runCount() const
+	{
+		return RunCount;
+	}
+
+private:
+	std::thread Worker;
+	std::mutex Mutex;
+	std::condition_variable Wake;
+	std::condition_variable Done;
+	bool Pending = false;
+	bool Stopping = false;
+
+	const HeightPyramid* Pyramid = nullptr;
+	int Rez = 0;
+	glm::vec2 TerrainSize = glm::vec2(0.0f);
+	glm::vec3 Camera = glm::vec3(0.0f);
+
+	// the grid in cells of 2^level patches a side, the ones on the far edges cut short. height bounds per cell, from
+	// prepare(), also by row (row outer, column inner) so the rows of a ring read them in order
+	// too. the corner lines and distances split in x and z of its columns and rows, padded for the 4 wide loads
+	struct Level
+	{
+		int Rez = 0;
+		std::vector<float> Low, High, LowByRow, HighByRow;
+		std::vector<float> CornerX, CornerZ, AxisNearX, AxisFarX, AxisNearZ, AxisFarZ;
+	};
+	const HeightPyramid* BoundsPyramid = nullptr;
+	int BoundsRez = 0;
+	std::vector<Level> Levels;
+
+	// the camera and grid of the last cull. the horizon doesn't depend on where the camera looks, so the runs are
+	// kept while it only turns
+	const HeightPyramid* CulledPyramid = nullptr;
+	int CulledRez = 0;
+	glm::vec2 CulledSize = glm::vec2(0.0f);
+	glm::vec3 CulledCamera = glm::vec3(NAN);
+
+	// the cells of one ring in the order of the walk as column << 16 | row, with their bounds and inverse distances.
+	// TestFirst..TestLast are the horizon bins a cell touches and RaiseFirst..RaiseLast the ones completely inside
+	// it, both empty for the cells the camera is over. the first bins are wrapped into the horizon, the last ones are
+	// kept the same distance after them
+	std::vector<int> Order;
+	std::vector<int> TestFirst, TestLast, RaiseFirst, RaiseLast;
+	std::vector<float> InvNear, InvFar, OrderLow, OrderHigh;
+	// the cells of the ring found hidden, and the ones left to raise the horizon with
+	std::vector<int> Covered, Uncovered;
+	std::vector<float> Angles0, Angles1;
+
+	// per frame
+	std::vector<unsigned char> Visible;
+	// padded for the 16 bins read from the last block
+	alignas(16) float Horizon[HORIZON_CULL_BINS + 12];
+#ifdef HR_SSE2
+	// lane masks by their movemask bits
+	alignas(16) static constexpr uint32_t LANES[16][4] = {
+		{ 0, 0, 0, 0 }, { ~0u, 0, 0, 0 }, { 0, ~0u, 0, 0 }, { ~0u, ~0u, 0, 0 },
+		{ 0, 0, ~0u, 0 }, { ~0u, 0, ~0u, 0 }, { 0, ~0u, ~0u, 0 }, { ~0u, ~0u, ~0u, 0 },
+		{ 0, 0, 0, ~0u }, { ~0u, 0, 0, ~0u }, { 0, ~0u, 0, ~0u }, { ~0u, ~0u, 0, ~0u },
+		{ 0, 0, ~0u, ~0u }, { ~0u, 0, ~0u, ~0u }, { 0, ~0u, ~0u, ~0u }, { ~0u, ~0u, ~0u, ~0u } };
+#endif
+	static constexpr float BINS_PER_UNIT = HORIZON_CULL_BINS / 4.0f;
+
+	std::vector<GLint> RunFirst;
+	std::vector<GLsizei> RunCount;
+
+	void run()
+	{
+		std::unique_lock<std::mutex> lock(Mutex);
+		while (true)
+		{
+			Wake.wait(lock, [this] { return Pending || Stopping; });
+			if (Stopping)
+				return;
+			// the job fields stay put until Pending is cleared
+			lock.unlock();
+			cull();
+			lock.lock();
+			Pending = false;
+			Done.notify_all();
+		}
+	}
+
+	// monotonic in the angle of (x, z) and much cheaper than atan2, 0..4 for a full turn
+	static float pseudoAngle(float x, float z)
+	{
+		float p = z / (std::abs(x) + std::abs(z));
+		return x < 0.0f ? 2.0f - p : (z < 0.0f ? 4.0f + p : p);
+	}
+
+#ifdef HR_SSE2
+	// 1 / v and 1 / sqrt(v) from the estimates with one Newton step, good to about 22 bits and much cheaper than
+	// the divides and square roots
+	static __m128 reciprocal4(__m128 v)
+	{
+		__m128 r = _mm_rcp_ps(v);
+		return _mm_mul_ps(r, _mm_sub_ps(_mm_set1_ps(2.0f), _mm_mul_ps(v, r)));
+	}
+
+	static __m128 rsqrt4(__m128 v)
+	{
+		__m128 r = _mm_rsqrt_ps(v);
+		return _mm_mul_ps(_mm_mul_ps(_mm_set1_ps(0.5f), r), _mm_sub_ps(_mm_set1_ps(3.0f), _mm_mul_ps(_mm_mul_ps(v, r), r)));
+	}
+
+	static __m128 pseudoAngle4(__m128 x, __m128 z)
+	{
+		__m128 p = _mm_mul_ps(z, reciprocal4(_mm_add_ps(abs4(x), abs4(z))));
+		__m128 left = _mm_cmplt_ps(x, _mm_setzero_ps()), below = _mm_cmplt_ps(z, _mm_setzero_ps());
+		__m128 right = _mm_add_ps(p, _mm_and_ps(below, _mm_set1_ps(4.0f)));
+		return _mm_or_ps(_mm_and_ps(left, _mm_sub_ps(_mm_set1_ps(2.0f), p)), _mm_andnot_ps(left, right));
+	}
+
+	static __m128 select4(__m128 mask, __m128 a, __m128 b)
+	{
+		return _mm_or_ps(_mm_and_ps(mask, a), _mm_andnot_ps(mask, b));
+	}
+#endif
+
+	// appends count cells along a row or a column of a level to the walk. along is the side's run of cell corners
+	// (x for a row, z for a column) with the distances split on that axis, cross the two corner lines and the
+	// distances on the other one
+	void addSide(bool row, const float* along, const float* alongNear, const float* alongFar, float cross0, float cross1, float crossNear, float crossFar,
+		const float* low, const float* high, int firstCell, int cellStride, int count)
+	{
+		// pseudo angles of the corners on both lines
+		int n = 0;
+#ifdef HR_SSE2
+		__m128 c0 = _mm_set1_ps(cross0), c1 = _mm_set1_ps(cross1);
+		for (; n <= count; n += 4)
+		{
+			__m128 a = _mm_loadu_ps(&along[n]);
+			_mm_storeu_ps(&Angles0[n], row ? pseudoAngle4(a, c0) : pseudoAngle4(c0, a));
+			_mm_storeu_ps(&Angles1[n], row ? pseudoAngle4(a, c1) : pseudoAngle4(c1, a));
+		}
+#endif
+		for (; n <= count; n++)
+		{
+			Angles0[n] = row ? pseudoAngle(along[n], cross0) : pseudoAngle(cross0, along[n]);
+			Angles1[n] = row ? pseudoAngle(along[n], cross1) : pseudoAngle(cross1, along[n]);
+		}
+
+		// the 4 wide stores run up to 3 cells past the side, the next side or the padding of the ring takes them
+		int at = (int)Order.size();
+		Order.resize(at + count);
+		for (int k = 0; k < count; k++)
+			Order[at + k] = firstCell + k * cellStride;
+		const float* a0 = Angles0.data();
+		const float* a1 = Angles1.data();
+		int k = 0;
+#ifdef HR_SSE2
+		const __m128 two = _mm_set1_ps(2.0f), four = _mm_set1_ps(4.0f), binsPerUnit = _mm_set1_ps(BINS_PER_UNIT), turn = _mm_set1_ps((float)HORIZON_CULL_BINS);
+		__m128 crossNear2 = _mm_set1_ps(crossNear * crossNear), crossFar2 = _mm_set1_ps(crossFar * crossFar);
+		for (; k < count; k += 4)
+		{
+			__m128 a = _mm_loadu_ps(&a0[k]), b = _mm_loadu_ps(&a0[k + 1]);
+			__m128 c = _mm_loadu_ps(&a1[k]), d = _mm_loadu_ps(&a1[k + 1]);
+			__m128 lo = _mm_min_ps(_mm_min_ps(a, b), _mm_min_ps(c, d));
+			__m128 hi = _mm_max_ps(_mm_max_ps(a, b), _mm_max_ps(c, d));
+			// across the 0/4 seam east of the eye, the corners past 2 go a turn back. only a few cells next to the
+			// camera's row
+			__m128 seam = _mm_cmpgt_ps(_mm_sub_ps(hi, lo), two);
+			if (_mm_movemask_ps(seam))
+			{
+				a = _mm_sub_ps(a, _mm_and_ps(_mm_cmpgt_ps(a, two), four));
+				b = _mm_sub_ps(b, _mm_and_ps(_mm_cmpgt_ps(b, two), four));
+				c = _mm_sub_ps(c, _mm_and_ps(_mm_cmpgt_ps(c, two), four));
+				d = _mm_sub_ps(d, _mm_and_ps(_mm_cmpgt_ps(d, two), four));
+				lo = select4(seam, _mm_min_ps(_mm_min_ps(a, b), _mm_min_ps(c, d)), lo);
+				hi = select4(seam, _mm_max_ps(_mm_max_ps(a, b), _mm_max_ps(c, d)), hi);
+			}
+
+			__m128 nearAlong = _mm_loadu_ps(&alongNear[k]), farAlong = _mm_loadu_ps(&alongFar[k]);
+			__m128 near2 = _mm_add_ps(crossNear2, _mm_mul_ps(nearAlong, nearAlong));
+			_mm_storeu_ps(&InvNear[at + k], rsqrt4(near2));
+			_mm_storeu_ps(&InvFar[at + k], rsqrt4(_mm_add_ps(crossFar2, _mm_mul_ps(farAlong, farAlong))));
+
+			// the camera is over the cell, it sees it in every direction
+			__m128i over = _mm_castps_si128(_mm_or_ps(_mm_cmpeq_ps(near2, _mm_setzero_ps()), _mm_cmpge_ps(_mm_sub_ps(hi, lo), two)));
+			// a turn ahead, spans start at most half a turn before 0 and truncating is flooring. the masks below take
+			// the turn off again
+			lo = _mm_add_ps(_mm_mul_ps(lo, binsPerUnit), turn);
+			hi = _mm_add_ps(_mm_mul_ps(hi, binsPerUnit), turn);
+			__m128i lowBin = _mm_cvttps_epi32(lo), highBin = _mm_cvttps_epi32(hi);
+			__m128i insideFirst = _mm_sub_epi32(lowBin, _mm_castps_si128(_mm_cmpneq_ps(_mm_cvtepi32_ps(lowBin), lo)));
+			__m128i one = _mm_set1_epi32(1);
+			__m128i wrap = _mm_set1_epi32(HORIZON_CULL_BINS - 1);
+			__m128i testFirst = _mm_and_si128(lowBin, wrap), raiseFirst = _mm_and_si128(insideFirst, wrap);
+			__m128i testLast = _mm_add_epi32(testFirst, _mm_sub_epi32(highBin, lowBin));
+			__m128i raiseLast = _mm_add_epi32(raiseFirst, _mm_sub_epi32(_mm_sub_epi32(highBin, one), insideFirst));
+			_mm_storeu_si128((__m128i*)&TestFirst[at + k], _mm_or_si128(_mm_and_si128(over, one), _mm_andnot_si128(over, testFirst)));
+			_mm_storeu_si128((__m128i*)&TestLast[at + k], _mm_andnot_si128(over, testLast));
+			_mm_storeu_si128((__m128i*)&RaiseFirst[at + k], _mm_or_si128(_mm_and_si128(over, one), _mm_andnot_si128(over, raiseFirst)));
+			_mm_storeu_si128((__m128i*)&RaiseLast[at + k], _mm_andnot_si128(over, raiseLast));
+		}
+#endif
+		for (; k < count; k++)
+		{
+			float a = a0[k], b = a0[k + 1], c = a1[k], d = a1[k + 1];
+			float lo = std::min(std::min(a, b), std::min(c, d)), hi = std::max(std::max(a, b), std::max(c, d));
+			if (hi - lo > 2.0f)
+			{
+				a -= a > 2.0f ? 4.0f : 0.0f;
+				b -= b > 2.0f ? 4.0f : 0.0f;
+				c -= c > 2.0f ? 4.0f : 0.0f;
+				d -= d > 2.0f ? 4.0f : 0.0f;
+				lo = std::min(std::min(a, b), std::min(c, d));
+				hi = std::max(std::max(a, b), std::max(c, d));
+			}
+			float dn = std::sqrt(crossNear * crossNear + alongNear[k] * alongNear[k]);
+			float df = std::sqrt(crossFar * crossFar + alongFar[k] * alongFar[k]);
+			InvNear[at + k] = 1.0f / dn;
+			InvFar[at + k] = 1.0f / df;
+			bool over = dn == 0.0f || hi - lo >= 2.0f;
+			int lowBin = (int)std::floor(lo * BINS_PER_UNIT), highBin = (int)std::floor(hi * BINS_PER_UNIT), insideFirst = (int)std::ceil(lo * BINS_PER_UNIT);
+			TestFirst[at + k] = over ? 1 : lowBin & (HORIZON_CULL_BINS - 1);
+			TestLast[at + k] = over ? 0 : TestFirst[at + k] + highBin - lowBin;
+			RaiseFirst[at + k] = over ? 1 : insideFirst & (HORIZON_CULL_BINS - 1);
+			RaiseLast[at + k] = over ? 0 : RaiseFirst[at + k] + highBin - 1 - insideFirst;
+		}
+		std::copy(low, low + count, &OrderLow[at]);
+		std::copy(high, high + count, &OrderHigh[at]);
+	}
+
+	// the corner lines and distances of a level of cells shift patches a side, for the camera at eye (x, z)
+	void axes(Level& level, int shift, glm::vec2 eye)
+	{
+		int rez = level.Rez, padded = rez + 8;
+		float patchX = TerrainSize.x / Rez, patchZ = TerrainSize.y / Rez;
+		level.CornerX.resize(padded);
+		level.CornerZ.resize(padded);
+		level.AxisNearX.assign(padded, 0.0f);
+		level.AxisFarX.assign(padded, 0.0f);
+		level.AxisNearZ.assign(padded, 0.0f);
+		level.AxisFarZ.assign(padded, 0.0f);
+		for (int i = 0; i < padded; i++)
+		{
+			int patch = std::min(i, rez) << shift;
+			level.CornerX[i] = -TerrainSize.x * 0.5f + std::min(patch, Rez) * patchX - eye.x;
+			level.CornerZ[i] = -TerrainSize.y * 0.5f + std::min(patch, Rez) * patchZ - eye.y;
+		}
+		for (int i = 0; i < rez; i++)
+		{
+			level.AxisNearX[i] = std::max(std::max(level.CornerX[i], -level.CornerX[i + 1]), 0.0f);
+			level.AxisFarX[i] = std::max(std::abs(level.CornerX[i]), std::abs(level.CornerX[i + 1]));
+			level.AxisNearZ[i] = std::max(std::max(level.CornerZ[i], -level.CornerZ[i + 1]), 0.0f);
+			level.AxisFarZ[i] = std::max(std::abs(level.CornerZ[i]), std::abs(level.CornerZ[i + 1]));
+		}
+	}
+
+	// cell bounds of every level, the first from the pyramid and the others from the cells of the one before
+	void buildLevels(const HeightPyramid& pyramid, int rez)
+	{
+		Levels.clear();
+		Levels.emplace_back();
+		Level& patches = Levels.back();
+		patches.Rez = rez;
+		patches.Low.resize(rez * rez);
+		patches.High.resize(rez * rez);
+		for (int i = 0; i < rez; i++)
+			for (int j = 0; j < rez; j++)
+				pyramid.bounds(i / (float)rez, j / (float)rez, (i + 1) / (float)rez, (j + 1) / (float)rez, patches.Low[i * rez + j], patches.High[i * rez + j]);
+		while (Levels.back().Rez > 1)
+		{
+			Levels.emplace_back();
+			const Level& fine = Levels[Levels.size() - 2];
+			Level& level = Levels.back();
+			int fineRez = fine.Rez;
+			level.Rez = (fineRez + 1) / 2;
+			level.Low.assign(level.Rez * level.Rez, INFINITY);
+			level.High.assign(level.Rez * level.Rez, -INFINITY);
+			for (int i = 0; i < fineRez; i++)
+				for (int j = 0; j < fineRez; j++)
+				{
+					int cell = (i / 2) * level.Rez + j / 2;
+					level.Low[cell] = std::min(level.Low[cell], fine.Low[i * fineRez + j]);
+					level.High[cell] = std::max(level.High[cell], fine.High[i * fineRez + j]);
+				}
+		}
+		for (Level& level : Levels)
+		{
+			int n = level.Rez;
+			level.LowByRow.resize(n * n);
+			level.HighByRow.resize(n * n);
+			for (int i = 0; i < n; i++)
+				for (int j = 0; j < n; j++)
+				{
+					level.LowByRow[j * n + i] = level.Low[i * n + j];
+					level.HighByRow[j * n + i] = level.High[i * n + j];
+				}
+		}
+	}
+
+	// horizon bins first..last all above slope, first is a bin and last can run up to half a turn past the end
+	bool below(int first, int last, float slope) const
+	{
+		if (last < HORIZON_CULL_BINS)
+			return belowBins(first, last, slope);
+		return belowBins(first, HORIZON_CULL_BINS - 1, slope) && belowBins(0, last - HORIZON_CULL_BINS, slope);
+	}
+
+	// raises the horizon bins first..last to slope
+	void raise(int first, int last, float slope)
+	{
+		if (last < HORIZON_CULL_BINS)
+			return raiseBins(first, last, slope);
+		raiseBins(first, HORIZON_CULL_BINS - 1, slope);
+		raiseBins(0, last - HORIZON_CULL_BINS, slope);
+	}
+
+	bool belowBins(int first, int last, float slope) const
+	{
+#ifdef HR_SSE2
+		// aligned blocks of 4 bins, neighbouring cells share blocks and unaligned ones would stall on the stores
+		// raise() just made. most cells are in the 16 bins from their first block, those are all compared and
+		// masked to first..last without branching on how many blocks they touch
+		__m128 s = _mm_set1_ps(slope);
+		int bin = first & ~3, span = last - bin;
+		if (span < 16)
+		{
+			unsigned inside = ((2u << span) - 1) & ~((1u << (first & 3)) - 1);
+			unsigned above = _mm_movemask_ps(_mm_cmpgt_ps(_mm_load_ps(&Horizon[bin]), s))
+				| _mm_movemask_ps(_mm_cmpgt_ps(_mm_load_ps(&Horizon[bin + 4]), s)) << 4
+				| _mm_movemask_ps(_mm_cmpgt_ps(_mm_load_ps(&Horizon[bin + 8]), s)) << 8
+				| _mm_movemask_ps(_mm_cmpgt_ps(_mm_load_ps(&Horizon[bin + 12]), s)) << 12;
+			return (above & inside) == inside;
+		}
+		int end = last & ~3;
+		if ((_mm_movemask_ps(_mm_cmpgt_ps(_mm_load_ps(&Horizon[bin]), s)) | ((1 << (first & 3)) - 1)) != 15)
+			return false;
+		for (bin += 4; bin < end; bin += 4)
+			if (_mm_movemask_ps(_mm_cmpgt_ps(_mm_load_ps(&Horizon[bin]), s)) != 15)
+				return false;
+		return (_mm_movemask_ps(_mm_cmpgt_ps(_mm_load_ps(&Horizon[end]), s)) | ((14 << (last & 3)) & 15)) == 15;
+#else
+		for (int bin = first; bin <= last; bin++)
+			if (!(Horizon[bin] > slope))
+				return false;
+		return true;
+#endif
+	}
+
+	void raiseBins(int first, int last, float slope)
+	{
+#ifdef HR_SSE2
+		// like belowBins(), the lanes outside first..last get -inf instead of slope
+		__m128 s = _mm_set1_ps(slope), none = _mm_set1_ps(-INFINITY);
+		int bin = first & ~3, span = last - bin;
+		if (span < 16)
+		{
+			unsigned outside = ~(((2u << span) - 1) & ~((1u << (first & 3)) - 1));
+			for (int block = 0; block < 4; block++, bin += 4)
+				_mm_store_ps(&Horizon[bin], _mm_max_ps(_mm_load_ps(&Horizon[bin]), select4(_mm_load_ps((const float*)LANES[(outside >> block * 4) & 15]), none, s)));
+			return;
+		}
+		int end = last & ~3;
+		_mm_store_ps(&Horizon[bin], _mm_max_ps(_mm_load_ps(&Horizon[bin]), select4(_mm_load_ps((const float*)LANES[(1 << (first & 3)) - 1]), none, s)));
+		for (bin += 4; bin < end; bin += 4)
+			_mm_store_ps(&Horizon[bin], _mm_max_ps(_mm_load_ps(&Horizon[bin]), s));
+		_mm_store_ps(&Horizon[end], _mm_max_ps(_mm_load_ps(&Horizon[end]), select4(_mm_load_ps((const float*)LANES[(14 << (last & 3)) & 15]), none, s)));
+#else
+		for (int bin = first; bin <= last; bin++)
+			Horizon[bin] = std::max(Horizon[bin], slope);
+#endif
+	}
+
+	// the square rings of cells around the camera's cell (ci, cj), each as its rows and then its columns without
+	// the corners, clipped to bi0..bi1 x bj0..bj1. the inner rings were walked on the levels before
+	void walk(Level& level, int shift, int ci, int cj, int bi0, int bi1, int bj0, int bj1, int& hidden)
+	{
+		axes(level, shift, glm::vec2(Camera.x, Camera.z));
+		int n = level.Rez, size = 1 << shift;
+		const std::vector<float>& cornerX = level.CornerX, & cornerZ = level.CornerZ;
+		int firstRing = std::max(std::max(std::max(bi0 - ci, ci - bi1), std::max(bj0 - cj, cj - bj1)), shift ? HORIZON_CULL_RINGS + 1 : 0);
+		int lastRing = std::max(std::max(ci - bi0, bi1 - ci), std::max(cj - bj0, bj1 - cj));
+		for (int k = firstRing; k <= lastRing; k++)
+		{
+			Order.clear();
+			int i0 = std::max(ci - k, bi0), i1 = std::min(ci + k, bi1);
+			int j0 = std::max(cj - k + 1, bj0), j1 = std::min(cj + k - 1, bj1);
+			for (int j : { cj - k, cj + k })
+			{
+				if (j >= bj0 && j <= bj1 && i0 <= i1)
+					addSide(true, &cornerX[i0], &level.AxisNearX[i0], &level.AxisFarX[i0], cornerZ[j], cornerZ[j + 1], level.AxisNearZ[j], level.AxisFarZ[j],
+						&level.LowByRow[j * n + i0], &level.HighByRow[j * n + i0], i0 << 16 | j, 1 << 16, i1 - i0 + 1);
+				if (k == 0)
+					break;
+			}
+			for (int i : { ci - k, ci + k })
+			{
+				if (k > 0 && i >= bi0 && i <= bi1 && j0 <= j1)
+					addSide(false, &cornerZ[j0], &level.AxisNearZ[j0], &level.AxisFarZ[j0], cornerX[i], cornerX[i + 1], level.AxisNearX[i], level.AxisFarX[i],
+						&level.Low[i * n + j0], &level.High[i * n + j0], i << 16 | j0, 1, j1 - j0 + 1);
+			}
+
+			const int *order = Order.data(), *testFirst = TestFirst.data(), *testLast = TestLast.data();
+			const int *raiseFirst = RaiseFirst.data(), *raiseLast = RaiseLast.data();
+			const float *invNear = InvNear.data(), *invFar = InvFar.data(), *low = OrderLow.data(), *high = OrderHigh.data();
+			int *covered = Covered.data(), *uncovered = Uncovered.data();
+			float eye = Camera.y;
+			int count = (int)Order.size(), hiding = 0, raising = 0;
+			for (int q = 0; q < count; q++)
+			{
+				// steepest the cell can look
+				float rise = high[q] - eye;
+				float slope = rise * (rise >= 0.0f ? invNear[q] : invFar[q]);
+				// whether it is hidden is about a coin flip, so no branches on it
+				bool under = below(testFirst[q], testLast[q], slope) & (testFirst[q] <= testLast[q]);
+				covered[hiding] = order[q];
+				hiding += under;
+				// hidden ones are under the horizon already, and so is anything they would add to it
+				uncovered[raising] = q;
+				raising += !under & (raiseFirst[q] <= raiseLast[q]);
+			}
+			for (int m = 0; m < raising; m++)
+			{
+				// along every ray through the cell the ground is at least Low high, the flattest that can look is at
+				// its far end above the eye and at its near end below
+				int q = uncovered[m];
+				float rise = low[q] - eye;
+				raise(raiseFirst[q], raiseLast[q], rise * (rise >= 0.0f ? invFar[q] : invNear[q]));
+			}
+			// and the patches of the hidden ones
+			unsigned char* visible = Visible.data();
+			if (shift == 0)
+			{
+				for (int m = 0; m < hiding; m++)
+					visible[(covered[m] >> 16) * Rez + (covered[m] & 0xffff)] = 0;
+				hidden += hiding;
+				continue;
+			}
+			for (int m = 0; m < hiding; m++)
+			{
+				int pi0 = covered[m] >> 16 << shift, pi1 = std::min(pi0 + size, Rez), pj0 = (covered[m] & 0xffff) << shift, pj1 = std::min(pj0 + size, Rez);
+				for (int pi = pi0; pi < pi1; pi++)
+					for (int pj = pj0; pj < pj1; pj++)
+						visible[pi * Rez + pj] = 0;
+				hidden += (pi1 - pi0) * (pj1 - pj0);
+			}
+		}
+	}
+
+	void cull()
+	{
+		auto start = std::chrono::steady_clock::now();
+		int rez = Rez, patches = rez * rez;
+		bool prepared = BoundsPyramid == Pyramid && BoundsRez == rez;
+		if (prepared && CulledPyramid == Pyramid && CulledRez == rez && CulledSize == TerrainSize && CulledCamera == Camera)
+		{
+			Milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+			return;
+		}
+
+		// a ring has at most 4 * rez cells, plus the 4 wide stores running past its last side
+		int ringSize = 4 * rez + 4;
+		TestFirst.resize(ringSize);
+		TestLast.resize(ringSize);
+		RaiseFirst.resize(ringSize);
+		RaiseLast.resize(ringSize);
+		InvNear.resize(ringSize);
+		InvFar.resize(ringSize);
+		OrderLow.resize(ringSize);
+		OrderHigh.resize(ringSize);
+		Covered.resize(ringSize);
+		Uncovered.resize(ringSize);
+		Angles0.resize(rez + 8);
+		Angles1.resize(rez + 8);
+
+		std::fill(std::begin(Horizon), std::end(Horizon), -INFINITY);
+		Visible.assign(patches, 1);
+		int hidden = 0;
+		// the camera's patch, clamped far enough out to keep the ring order
+		float patchX = TerrainSize.x / rez, patchZ = TerrainSize.y / rez;
+		int ci = (int)std::clamp(std::floor((Camera.x + TerrainSize.x * 0.5f) / patchX), -1e6f, 1e6f);
+		int cj = (int)std::clamp(std::floor((Camera.z + TerrainSize.y * 0.5f) / patchZ), -1e6f, 1e6f);
+		for (int shift = 0; prepared && shift < (int)Levels.size(); shift++)
+		{
+			// the camera's cell and the square of the next level's first rings, the rest of the grid on the last level
+			Level& level = Levels[shift];
+			int n = level.Rez, lci = ci >> shift, lcj = cj >> shift;
+			int bi0 = 0, bi1 = n - 1, bj0 = 0, bj1 = n - 1;
+			bool last = shift + 1 == (int)Levels.size();
+			if (!last)
+			{
+				bi0 = std::max(bi0, ((lci >> 1) - HORIZON_CULL_RINGS) * 2);
+				bi1 = std::min(bi1, ((lci >> 1) + HORIZON_CULL_RINGS) * 2 + 1);
+				bj0 = std::max(bj0, ((lcj >> 1) - HORIZON_CULL_RINGS) * 2);
+				bj1 = std::min(bj1, ((lcj >> 1) + HORIZON_CULL_RINGS) * 2 + 1);
+				last = bi0 == 0 && bi1 == n - 1 && bj0 == 0 && bj1 == n - 1;
+			}
+			if (bi0 <= bi1 && bj0 <= bj1)
+				walk(level, shift, lci, lcj, bi0, bi1, bj0, bj1, hidden);
+			if (last)
+				break;
+		}
+
+		RunFirst.clear();
+		RunCount.clear();
+		const unsigned char* visible = Visible.data();
+		for (int p = 0; p < patches;)
+		{
+			const void* shown = memchr(visible + p, 1, patches - p);
+			if (!shown)
+				break;
+			p = (int)((const unsigned char*)shown - visible);
+			const void* gone = memchr(visible + p, 0, patches - p);
+			int end = gone ? (int)((const unsigned char*)gone - visible) : patches;
+			RunFirst.push_back(p);
+			RunCount.push_back(end - p);
+			p = end;
+		}
+		CulledPyramid = prepared ? Pyramid : nullptr;
+		CulledRez = rez;
+		CulledSize = TerrainSize;
+		CulledCamera = Camera;
+		Patches = patches;
+		Hidden = hidden;
+		Milliseconds = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+	}
+};
+
+#endif
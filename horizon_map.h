@@ -0,0 +1,223 @@
+#ifndef HORIZON_MAP_H
+#define HORIZON_MAP_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <mutex>
+#include <vector>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include "heightmap.h"
+#include "thread_pool.h"
+
+// azimuths the horizon is traced in, 4 per RGBA8 layer of the texture array
+const int HORIZON_DIRECTIONS = 8;
+const int HORIZON_LAYERS = HORIZON_DIRECTIONS / 4;
+// texels per side of a bake tile
+const int HORIZON_TILE = 128;
+const int HORIZON_UPLOADS_PER_FRAME = 8;
+
+// sine of the horizon elevation over every heightmap sample in HORIZON_DIRECTIONS azimuths, for sun shadows and
+// ambient occlusion without shadow map passes. direction i points at azimuth 2 pi i / HORIZON_DIRECTIONS in the xz
+// plane, x = cos, z = sin, like sunDirection. the texture starts out with a flat horizon everywhere and is baked
+// after load a tile at a time on the pool, so the render loop only uploads finished tiles
+class HorizonBaker
+{
+public:
+	// how far to look for the horizon, in samples
+	float MaxDistance = 512.0f;
+	int BakedTiles = 0;
+
+	~HorizonBaker()
+	{
+		if (!Pool)
+			return;
+		Stopping = true;
+		// queued tiles return right away
+		Pool->wait();
+	}
+
+	bool started() const
+	{
+		return Pool != nullptr;
+	}
+
+	bool done() const
+	{
+		return Pool && BakedTiles == tileCount();
+	}
+
+	int tileCount() const
+	{
+		return TilesX * TilesY * HORIZON_LAYERS;
+	}
+
+	GLuint texture() const
+	{
+		return Texture;
+	}
+
+	// map has to outlive the baker. spacing is the distance between samples in model units
+	void start(const Heightmap& map, float spacingX, float spacingZ, ThreadPool& pool)
+	{
+		Map = &map;
+		Pool = &pool;
+		SpacingX = spacingX;
+		SpacingZ = spacingZ;
+		TilesX = (map.Width + HORIZON_TILE - 1) / HORIZON_TILE;
+		TilesY = (map.Height + HORIZON_TILE - 1) / HORIZON_TILE;
+		// the middle of the map first, that is where the camera starts
+		for (int i = 0; i < tileCount(); i++)
+			Pending.push_back(i);
+		std::stable_sort(Pending.begin(), Pending.end(), [this](int a, int b) { return centerDistance(a) < centerDistance(b); });
+
+		Levels = mipLevelCount(map.Width, map.Height);
+		glGenTextures(1, &Texture);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, Texture);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		// mipmaps are generated once everything is baked
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, 0);
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, Levels, GL_RGBA8, map.Width, map.Height, HORIZON_LAYERS);
+		unsigned char flat[4] = { 0, 0, 0, 0 };
+		glClearTexImage(Texture, 0, GL_RGBA, GL_UNSIGNED_BYTE, flat);
+	}
+
+	void destroy()
+	{
+		glDeleteTextures(1, &Texture);
+	}
+
+	// keeps some tiles baking on the pool and uploads the finished ones, returns true when the last one went in
+	bool update()
+	{
+		if (!Pool || done())
+			return false;
+		// a worker stays free for the tile streamer and other load work
+		int maxInFlight = std::max(1, (int)Pool->size() - 1);
+		while (InFlight < maxInFlight && !Pending.empty())
+		{
+			int tile = Pending.front();
+			Pending.pop_front();
+			InFlight++;
+			Pool->submit([this, tile] { bake(tile); });
+		}
+
+		glBindTexture(GL_TEXTURE_2D_ARRAY, Texture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+		for (int i = 0; i < HORIZON_UPLOADS_PER_FRAME; i++)
+		{
+			BakedTile baked;
+			{
+				std::lock_guard<std::mutex> lock(Mutex);
+				if (Baked.empty())
+					break;
+				baked = std::move(Baked.front());
+				Baked.pop_front();
+			}
+			InFlight--;
+			int x0, y0, w, h;
+			tileRect(baked.Tile, x0, y0, w, h);
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, x0, y0, baked.Tile % HORIZON_LAYERS, w, h, 1, GL_RGBA, GL_UNSIGNED_BYTE, baked.Texels.data());
+			BakedTiles++;
+		}
+		if (!done())
+			return false;
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAX_LEVEL, Levels - 1);
+		glGenerateMipmap(GL_TEXTURE_2D_ARRAY);
+		return true;
+	}
+
+private:
+	struct BakedTile
+	{
+		int Tile = 0;
+		std::vector<unsigned char> Texels;
+	};
+
+	const Heightmap* Map = nullptr;
+	ThreadPool* Pool = nullptr;
+	float SpacingX = 1.0f;
+	float SpacingZ = 1.0f;
+	int TilesX = 0;
+	int TilesY = 0;
+	int Levels = 1;
+	GLuint Texture = 0;
+
+	// tile indices are (y * TilesX + x) * HORIZON_LAYERS + layer, a task bakes the 4 directions of one layer
+	std::deque<int> Pending;
+	int InFlight = 0;
+	std::atomic<bool> Stopping{ false };
+	std::mutex Mutex;
+	std::deque<BakedTile> Baked;
+
+	void tileRect(int tile, int& x0, int& y0, int& w, int& h) const
+	{
+		int t = tile / HORIZON_LAYERS;
+		x0 = t % TilesX * HORIZON_TILE;
+		y0 = t / TilesX * HORIZON_TILE;
+		w = std::min(HORIZON_TILE, Map->Width - x0);
+		h = std::min(HORIZON_TILE, Map->Height - y0);
+	}
+
+	float centerDistance(int tile) const
+	{
+		int t = tile / HORIZON_LAYERS;
+		float dx = t % TilesX + 0.5f - TilesX * 0.5f, dy = t / TilesX + 0.5f - TilesY * 0.5f;
+		return dx * dx + dy * dy;
+	}
+
+	void bake(int tile)
+	{
+		BakedTile baked;
+		baked.Tile = tile;
+		if (!Stopping)
+		{
+			int x0, y0, w, h;
+			tileRect(tile, x0, y0, w, h);
+			baked.Texels.resize((size_t)w * h * 4);
+			int layer = tile % HORIZON_LAYERS;
+			for (int c = 0; c < 4; c++)
+			{
+				float azimuth = 6.2831853f * (layer * 4 + c) / HORIZON_DIRECTIONS;
+				// one sample step in model units along the direction, and its length
+				float stepX = std::cos(azimuth) / SpacingX, stepZ = std::sin(azimuth) / SpacingZ;
+				float stepLength = 1.0f / std::max(std::abs(stepX), std::abs(stepZ));
+				stepX *= stepLength;
+				stepZ *= stepLength;
+				for (int y = 0; y < h && !Stopping; y++)
+					for (int x = 0; x < w; x++)
+						baked.Texels[((size_t)y * w + x) * 4 + c] = traceHorizon(x0 + x, y0 + y, stepX, stepZ, stepLength);
+			}
+		}
+		std::lock_guard<std::mutex> lock(Mutex);
+		Baked.push_back(std::move(baked));
+	}
+
+	// steepest slope towards any sample along the ray, single steps close by and growing ones further out.
+	// returned as the sine of its angle in unorm8, below the horizontal counts as flat
+	unsigned char traceHorizon(int x, int y, float stepX, float stepZ, float stepLength) const
+	{
+		float origin = Map->heightAt(x, y);
+		float slope = 0.0f;
+		float distance = 1.0f;
+		while (distance <= MaxDistance)
+		{
+			int sx = (int)std::lround(x + stepX * distance), sy = (int)std::lround(y + stepZ * distance);
+			if (sx < 0 || sy < 0 || sx >= Map->Width || sy >= Map->Height)
+				break;
+			slope = std::max(slope, (Map->heightAt(sx, sy) - origin) / (distance * stepLength));
+			distance = distance < 8.0f ? distance + 1.0f : distance * 1.25f;
+		}
+		float sine = slope / std::sqrt(1.0f + slope * slope);
+		return (unsigned char)std::lround(sine * 255.0f);
+	}
+};
+
+#endif
@@ -7,12 +7,38 @@
 #include <glm/glm.hpp>
 #include <GLFW/glfw3.h>
 #include <cmath>
+#include <cstddef>
 
 #define STB_IMAGE_IMPLEMENTATION
 #include "stb_image.h"
 #include <vector>
 #include "Shader.h"
 #include "camera.h"
+#include "heightmap.h"
+#include "heightmap_loader.h"
+#include "tile_streamer.h"
+#include "camera_motion.h"
+#include "heightmap_mosaic.h"
+#include <filesystem>
+#include "patch_grid.h"
+#include "roughness_map.h"
+#include "thread_pool.h"
+#include "frustum.h"
+#include "height_pyramid.h"
+#include "normal_map.h"
+#include "horizon_map.h"
+#include "hiz_pyramid.h"
+#include "patch_counter.h"
+#include "terrain_quadtree.h"
+#include "frame_constants.h"
+#include "gpu_timer.h"
+#include "terrain_benchmark.h"
+#include "horizon_culler.h"
+#include "gpu_culler.h"
+#include "tess_budget.h"
+#include "render_target.h"
+#include "frame_profiler.h"
+#include <cstring>
 #include <algorithm>
 
 
@@ -26,6 +52,22 @@ const unsigned int WIDTH = 1600;
 const unsigned int HEIGHT = 1200;
 const unsigned int NUM_PATCH_PTS = 4;
 
+// preprocessed tiled pyramid, used instead of the PNG when present
+const char* TERRAIN_PATH = "images/the_hague.hrt";
+// the hague heightmap stores 0..1 for -5.199m..157.8m
+const char* HEIGHTMAP_PATH = "images/the_hague_heightmap.png";
+const float HEIGHT_SCALE = 163.0f;
+const float HEIGHT_OFFSET = -5.199f;
+// directory of .asc sheets or index file, loaded instead of the single map when present
+const char* MOSAIC_PATH = "images/mosaic";
+const int MOSAIC_UPLOADS_PER_FRAME = 2;
+// .hrt levels bigger than this are streamed in tiles instead of being part of the height texture
+const int STREAMING_OVERVIEW_SIZE = 8192;
+const size_t STREAMING_CACHE_TILES = 1024;
+// tiles along the predicted camera path are prefetched at this many points in time
+const int PREFETCH_STEPS = 4;
+static float PrefetchSeconds = 0.5f;
+
 Camera camera(
 	glm::vec3(67.f, 627.f, 169.f),
 	glm::vec3(0.0f, 1.0f, 0.0f),
@@ -41,6 +83,52 @@ float lastFrame = 0.0f;
 bool glfw_cursor_normal = false;
 static float CameraMovementSpeed = 150.f;
 
+// how the patch corners reach the vertex shader
+enum RenderMode {
+	RENDER_INDEXED,   // shared vertex grid in terrainVBO/terrainEBO, rebuilt when the patch count changes
+	RENDER_VERTEX_ID, // no vertex buffers, corners computed from gl_VertexID
+	RENDER_QUADTREE,  // nodes picked by TerrainQuadtree, one instance of a fixed patch mesh per node
+	RENDER_GPU_CULLED // vertex ID grid over the patches a compute pass kept, one indirect draw per lod bucket
+};
+static int renderMode = RENDER_VERTEX_ID;
+static int PatchRez = 50;
+
+// how the TCS picks the tessellation levels
+enum TessMode {
+	TESS_DISTANCE,     // fixed distance range mapped to levels 16..64
+	TESS_SCREEN_SPACE  // projected edge length, constant triangle size on screen
+};
+static int tessMode = TESS_SCREEN_SPACE;
+static float TriangleSize = 12.f;
+
+// scale tessellation down on flat patches
+static bool useRoughness = true;
+static float RoughnessTolerance = 1.f;
+const int ROUGHNESS_CELLS = 256;
+
+// drop patches outside the view in the TCS
+static bool frustumCull = true;
+// and patches behind the last frame's depth
+static bool occlusionCull = true;
+// and patches behind nearer ridges, from the height bounds on the CPU
+static bool horizonCull = true;
+
+// lambert light from the precomputed normals, direction in degrees
+static bool useLighting = true;
+static float SunAzimuth = 135.f;
+static float SunElevation = 35.f;
+// sun shadows and ambient occlusion from the baked horizon map
+static bool useHorizon = true;
+static bool wireframe = true;
+
+// sample the heights at the mip matching the vertex spacing instead of the base level
+static bool explicitLod = true;
+static float LodBias = 0.f;
+
+// the scene is drawn offscreen at a scale of the window size and stretched over it, see render_target.h.
+// global for the resize callback
+static RenderTarget sceneTarget;
+
 
 void checkGPU() {
 	const GLubyte* renderer = glGetString(GL_RENDERER);  // GPU renderer
@@ -56,7 +144,7 @@ void checkGPU() {
 
 
 
-int main()
+int main(int argc, char** argv)
 {
 	// init glfw
 	if (!glfwInit())
@@ -98,109 +186,156 @@ int main()
 	}
 
 	glEnable(GL_DEPTH_TEST);
-	glPolygonMode(GL_FRONT_AND_BACK, GL_LINE);
+	{
+		int framebufferWidth, framebufferHeight;
+		glfwGetFramebufferSize(window, &framebufferWidth, &framebufferHeight);
+		sceneTarget.resize(framebufferWidth, framebufferHeight);
+	}
 
 	// load shader text files
 	Shader HeightShader(
 		"./vertex_shader.txt", "./fragment_shader.txt", "tesselation_control_shader.txt", "tesselation_evaluation_shader.txt"
 	);
+	Shader HiZShader("hiz_compute_shader.txt");
+	Shader CullShader("cull_compute_shader.txt");
 
 	std::cout << "opengl version: " << glGetString(GL_VERSION) << std::endl;
 	std::cout << "shading language: " << glGetString(GL_SHADING_LANGUAGE_VERSION) << std::endl;
 	checkGPU();
 
-	std::vector<float> vertices;
-
-	// load the heightmap as texture
-	unsigned int texture;
-	glGenTextures(1, &texture);
-	glActiveTexture(GL_TEXTURE0);
-	glBindTexture(GL_TEXTURE_2D, texture);
-	// wrapping params
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-	// filtering params
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-	// load image
-	int width, height, channels;
-	// https://stackoverflow.com/questions/23150123/loading-png-with-stb-image-for-opengl-texture-gives-wrong-colors
-	unsigned char* data = stbi_load("images/the_hague_heightmap.png", &width, &height, &channels, STBI_rgb_alpha);
-	if (data) {
-		//glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
-		std::cout << width << ", " << height << std::endl;
-		glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
-		glGenerateMipmap(GL_TEXTURE_2D);
-
-		HeightShader.setInt("heightMap", 0);
-		std::cout << "Heightmap dimension: (" << width << ", " << height << ")." << std::endl;
-	}
+	// workers for the load time passes over the heightmap
+	ThreadPool workers;
+
+	// the heightmap loads in the background and shows up coarsest level first, everything that depends on the
+	// heights is created in the main loop as soon as the loader has it
+	GLint maxTextureSize = 0;
+	glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+	// a mosaic is drawn sheet by sheet with the vertex id grid, without the quadtree, roughness and patch culling
+	std::error_code mosaicError;
+	bool mosaicMode = std::filesystem::exists(MOSAIC_PATH, mosaicError);
+	MosaicLoader mosaicLoader;
+	std::vector<MosaicSheet> sheets;
+	int sheetsDrawn = 0;
+	HeightmapLoader loader;
+	if (mosaicMode)
+		mosaicLoader.start(MOSAIC_PATH, HEIGHT_SCALE, HEIGHT_OFFSET, workers);
 	else
-	{
-		std::cout << "Failed to load" << std::endl;
-	}
-	stbi_image_free(data);
-
-	// generate all coordinates for all patches
-	unsigned int rez = 50;
-	for (unsigned i = 0; i < rez; i++)
-	{
-		for (unsigned int j = 0; j < rez; j++)
-		{
-			// patch top left
-			vertices.push_back(-width / 2.0f + width * i / (float)rez); // v.x
-			vertices.push_back(0.0f); // v.y
-			vertices.push_back(-height / 2.0f + height * j / (float)rez); // v.z
-			vertices.push_back(i / (float)rez); // u
-			vertices.push_back(j / (float)rez); // v
-
-			// patch top right
-			vertices.push_back(-width / 2.0f + width * (i+1) / (float)rez); // v.x
-			vertices.push_back(0.0f); // v.y
-			vertices.push_back(-height / 2.0f + height * j / (float)rez); // v.z
-			vertices.push_back((i + 1) / (float)rez);
-			vertices.push_back(j / (float)rez);
-
-			// patch bottom left
-			vertices.push_back(-width / 2.0f + width * i / (float)rez); // v.x
-			vertices.push_back(0.0f); // v.y
-			vertices.push_back(-height / 2.0f + height * (j+1) / (float)rez); // v.z
-			vertices.push_back(i / (float)rez); // u
-			vertices.push_back((j+1) / (float)rez); // v
-
-			// patch bottom right
-			vertices.push_back(-width / 2.0f + width * (i+1) / (float)rez); // v.x
-			vertices.push_back(0.0f); // v.y
-			vertices.push_back(-height / 2.0f + height * (j+1) / (float)rez); // v.z
-			vertices.push_back((i + 1) / (float)rez);
-			vertices.push_back((j + 1) / (float)rez);
-		}
-	}
-	std::cout << "Loaded: " << rez * rez << " patches of 4 control points each" << std::endl;
-	std::cout << "Processing " << rez * rez * 4 << " vertices in the vertex shader" << ::std::endl;
+		loader.start(TERRAIN_PATH, HEIGHTMAP_PATH, HEIGHT_SCALE, HEIGHT_OFFSET, ROUGHNESS_CELLS,
+			std::min<int>(maxTextureSize, STREAMING_OVERVIEW_SIZE), workers);
+	HeightUploader uploader;
+	// pages in the levels the height texture leaves out, on texture units 3 (page table) and 4 (pages)
+	TileStreamer streamer;
+	CameraMotion cameraMotion;
+	TerrainInfo terrainInfo;
+	GLuint texture = 0;
+	int width = 0, height = 0;
+
+	// per cell flatness for the TCS on texture unit 1, min/max heights for culling on unit 2
+	GLuint roughnessTexture = 0;
+	GLuint boundsTexture = 0;
+	// normals for lighting on unit 5, horizons for shadows and occlusion on unit 6 (not for mosaics)
+	GLuint normalTexture = 0;
+	HorizonBaker horizon;
+
+	PatchCounter patchCounter;
+	patchCounter.init();
+
+	// depth pyramid of the last frame for occlusion culling in the TCS
+	HiZPyramid hiz;
+
+	GpuTimer terrainTimer;
+	terrainTimer.init();
+	// scales the tessellation to keep terrainTimer near a target
+	TessBudget tessBudget;
+	// per pass timings for the Profiler window
+	FrameProfiler profiler;
+	profiler.init();
+	// --benchmark flies a fixed set of views once the terrain is fully loaded, prints the timings and quits
+	TerrainBenchmark benchmark;
+	for (int i = 1; i < argc; i++)
+		benchmark.Enabled |= std::strcmp(argv[i], "--benchmark") == 0;
+
+	// frustum and lod pass ahead of the indirect draw
+	GpuCuller gpuCuller;
+
+	// patches behind nearer ridges, drawn around as runs of the visible ones
+	HorizonCuller horizonCuller;
+	std::vector<GLint> cullerFirsts;
+	std::vector<GLsizei> cullerCounts;
+	std::vector<const void*> cullerOffsets;
+
+	FrameUniforms frameUniforms;
+	frameUniforms.init();
+
+	// quadtree over the heightmap for the quadtree render mode, built once the height pyramid exists
+	TerrainQuadtree quadtree;
+
+	// the node mesh has no vertex attributes, only the per instance node rect and lod
+	GLuint quadtreeVAO, quadtreeVBO;
+	glGenVertexArrays(1, &quadtreeVAO);
+	glBindVertexArray(quadtreeVAO);
+	glGenBuffers(1, &quadtreeVBO);
+	glBindBuffer(GL_ARRAY_BUFFER, quadtreeVBO);
+	glVertexAttribPointer(2, 4, GL_FLOAT, GL_FALSE, sizeof(QuadtreeInstance), (void*)0);
+	glEnableVertexAttribArray(2);
+	glVertexAttribDivisor(2, 1);
+	glVertexAttribPointer(3, 1, GL_FLOAT, GL_FALSE, sizeof(QuadtreeInstance), (void*)offsetof(QuadtreeInstance, Lod));
+	glEnableVertexAttribArray(3);
+	glVertexAttribDivisor(3, 1);
+	glBindVertexArray(0);
+	GLsizei quadtreeInstances = 0;
 
-	// VAO
+	// VAO for the indexed render mode, the grid is only generated once that mode is used
 	GLuint terrainVAO, terrainVBO, terrainEBO;
 	glGenVertexArrays(1, &terrainVAO);
 	glBindVertexArray(terrainVAO);
 
 	glGenBuffers(1, &terrainVBO);
 	glBindBuffer(GL_ARRAY_BUFFER, terrainVBO);
-	glBufferData(GL_ARRAY_BUFFER, vertices.size() * sizeof(float), &vertices[0], GL_STATIC_DRAW);
-
-	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)0);
+	glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, PATCH_GRID_STRIDE * sizeof(float), (void*)0);
 	glEnableVertexAttribArray(0);
-	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, 5 * sizeof(float), (void*)(sizeof(float) * 3));
+	glVertexAttribPointer(1, 2, GL_FLOAT, GL_FALSE, PATCH_GRID_STRIDE * sizeof(float), (void*)(sizeof(float) * 3));
 	glEnableVertexAttribArray(1);
 
+	glGenBuffers(1, &terrainEBO);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrainEBO);
+	glBindVertexArray(0);
 
-	glPatchParameteri(GL_PATCH_VERTICES, NUM_PATCH_PTS);
-
-	//glGenBuffers(1, &terrainEBO);
-	//glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, terrainEBO);
-	//glBufferData(GL_ELEMENT_ARRAY_BUFFER, indices.size() * sizeof(unsigned int), &indices[0], GL_STATIC_DRAW);
+	unsigned int gridRez = 0;
+	GLsizei gridIndexCount = 0;
+	// generate all coordinates for all patches, corners are shared between neighbouring patches
+	auto uploadPatchGrid = [&](unsigned int rez) {
+		PatchGrid grid = buildPatchGrid(rez, (float)width, (float)height);
+		glBindVertexArray(terrainVAO);
+		glBindBuffer(GL_ARRAY_BUFFER, terrainVBO);
+		glBufferData(GL_ARRAY_BUFFER, grid.Vertices.size() * sizeof(float), grid.Vertices.data(), GL_STATIC_DRAW);
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, grid.Indices.size() * sizeof(unsigned int), grid.Indices.data(), GL_STATIC_DRAW);
+		glBindVertexArray(0);
+		gridRez = rez;
+		gridIndexCount = (GLsizei)grid.Indices.size();
+		std::cout << "Loaded: " << grid.patchCount() << " patches of 4 control points each" << std::endl;
+		std::cout << "Processing " << grid.vertexCount() << " vertices in the vertex shader" << ::std::endl;
+	};
+
+	// the vertex id mode has no attributes but the core profile still wants a VAO bound
+	GLuint emptyVAO;
+	glGenVertexArrays(1, &emptyVAO);
 
-	glBindVertexArray(0);
+	glPatchParameteri(GL_PATCH_VERTICES, NUM_PATCH_PTS);
+	HeightShader.use();
+	HeightShader.setVec2("uvScale", 1.0f, 1.0f);
+	// every sampler on its own unit from the start, samplers of different types must never share one
+	HeightShader.setInt("heightMap", 0);
+	HeightShader.setInt("roughnessMap", 1);
+	HeightShader.setInt("heightBounds", 2);
+	HeightShader.setInt("pageTable", 3);
+	HeightShader.setInt("tilePages", 4);
+	HeightShader.setInt("normalMap", 5);
+	HeightShader.setInt("horizonMap", 6);
+	HeightShader.setInt("hizPyramid", HIZ_UNIT);
+	HeightShader.setInt("nodePatches", QUADTREE_NODE_PATCHES);
+	HeightShader.setInt("quadtreeTessLevel", QUADTREE_TESS_LEVEL);
+	HeightShader.setInt("quadtreeGridRez", QUADTREE_GRID_REZ);
 
 	//-----init IMGUI------------
 	IMGUI_CHECKVERSION();
@@ -219,8 +354,122 @@ int main()
 		deltaTime = currentFrame - lastFrame;
 		lastFrame = currentFrame;
 
+		profiler.beginFrame();
 		processInput(window);
 
+		// hand whatever the loader finished over to the GPU
+		if (loader.takeInfo(terrainInfo)) {
+			width = terrainInfo.Width;
+			height = terrainInfo.Height;
+			glActiveTexture(GL_TEXTURE0);
+			texture = createHeightStorage(terrainInfo);
+			uploader.init(texture, terrainInfo.LevelCount - terrainInfo.FirstLevel);
+			HeightShader.use();
+			HeightShader.setFloat("heightScale", terrainInfo.Scale);
+			HeightShader.setFloat("heightOffset", terrainInfo.Offset);
+			HeightShader.setVec2("heightRange", terrainInfo.MinHeight, terrainInfo.MaxHeight);
+			HeightShader.setVec2("terrainSize", (float)width, (float)height);
+			std::cout << "Loading " << terrainInfo.Source << ": " << terrainInfo.LevelCount << " levels" << std::endl;
+			std::cout << "Heightmap dimension: (" << width << ", " << height << ")." << std::endl;
+			std::cout << "Height range: " << terrainInfo.MinHeight << "m to " << terrainInfo.MaxHeight << "m" << std::endl;
+			if (terrainInfo.FirstLevel > 0 && streamer.init(TERRAIN_PATH, terrainInfo.FirstLevel, STREAMING_CACHE_TILES, workers)) {
+				glActiveTexture(GL_TEXTURE3);
+				glBindTexture(GL_TEXTURE_BUFFER, streamer.pageTableTexture());
+				glActiveTexture(GL_TEXTURE4);
+				glBindTexture(GL_TEXTURE_2D_ARRAY, streamer.pageTexture());
+				glActiveTexture(GL_TEXTURE0);
+				HeightShader.setInt("streamTiles", 1);
+				HeightShader.setInt("streamedLevels", streamer.streamedLevels());
+				HeightShader.setFloat("tileSize", streamer.tileSize());
+				HeightShader.setFloat("tileBorder", streamer.tileBorder());
+				HeightShader.setVec4Array("tileLevels", streamer.tileLevels().data(), streamer.streamedLevels());
+				HeightShader.setVec2Array("levelSizes", streamer.levelSizes().data(), streamer.streamedLevels());
+			}
+		}
+		int loadedLevel;
+		std::shared_ptr<const Heightmap> levelMap;
+		while (loader.takeLevel(loadedLevel, levelMap))
+			uploader.push(loadedLevel, std::move(levelMap));
+		if (texture && uploader.update()) {
+			int resident = uploader.residentLevel();
+			if (resident == terrainInfo.LevelCount - terrainInfo.FirstLevel - 1 || resident == 0)
+				std::cout << "Level " << resident << " resident after " << loader.secondsSinceStart() * 1000.0 << " ms" << std::endl;
+		}
+		MosaicSheet sheet;
+		for (int i = 0; i < MOSAIC_UPLOADS_PER_FRAME && mosaicLoader.takeSheet(sheet); i++) {
+			glActiveTexture(GL_TEXTURE0);
+			sheet.Texture = createHeightTexture(sheet.Map);
+			// neighbours share the edge samples, nothing to wrap around to
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+			glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+			glActiveTexture(GL_TEXTURE5);
+			sheet.NormalTexture = createNormalTexture(sheet.Normals);
+			glActiveTexture(GL_TEXTURE0);
+			// only the size and range are needed from here on
+			sheet.Map.Data16 = std::vector<uint16_t>();
+			sheet.Map.Data32 = std::vector<float>();
+			sheet.Normals.Data = std::vector<int8_t>();
+			sheets.push_back(std::move(sheet));
+			HeightShader.use();
+			glm::vec2 heightRange = mosaicLoader.heightRange();
+			HeightShader.setVec2("heightRange", heightRange.x, heightRange.y);
+			if (sheets.size() == 1)
+				std::cout << "Mosaic: " << mosaicLoader.Width << "x" << mosaicLoader.Height << " cells" << std::endl;
+		}
+
+		if (loader.takeAnalysis()) {
+			const RoughnessMap& roughness = loader.roughness();
+			const HeightPyramid& heightPyramid = loader.pyramid();
+			glActiveTexture(GL_TEXTURE1);
+			roughnessTexture = createRoughnessTexture(roughness);
+			glActiveTexture(GL_TEXTURE2);
+			boundsTexture = heightPyramid.createTexture();
+			glActiveTexture(GL_TEXTURE5);
+			normalTexture = createNormalTexture(loader.normals());
+			glActiveTexture(GL_TEXTURE0);
+			HeightShader.use();
+			HeightShader.setVec2("boundsTransform", heightPyramid.rangeScale(), heightPyramid.rangeOffset());
+			quadtree.build(heightPyramid, width, height);
+			horizonCuller.prepare(heightPyramid, PatchRez);
+			glActiveTexture(GL_TEXTURE6);
+			horizon.start(loader.heightmap(), (float)width / loader.heightmap().Width, (float)height / loader.heightmap().Height, workers);
+			glActiveTexture(GL_TEXTURE0);
+			std::cout << "Roughness map: " << roughness.Cells << "x" << roughness.Cells << " cells, height pyramid: "
+				<< heightPyramid.levelCount() << " levels, quadtree: " << quadtree.lodCount() << " lods, done after "
+				<< loader.secondsSinceStart() * 1000.0 << " ms on " << workers.size() << " threads" << std::endl;
+		}
+
+		if (benchmark.Enabled && !benchmark.started())
+		{
+			bool loaded = mosaicMode
+				? mosaicLoader.done() && !sheets.empty() && !mosaicLoader.pending()
+				: uploader.ready() && uploader.residentLevel() == 0 && !uploader.busy() && boundsTexture;
+			if (loaded)
+				benchmark.start(mosaicMode ? glm::vec2(mosaicLoader.Width, mosaicLoader.Height) : glm::vec2(width, height),
+					mosaicMode ? mosaicLoader.heightRange().y : terrainInfo.MaxHeight);
+			else if (loader.failed() || mosaicLoader.failed())
+				glfwSetWindowShouldClose(window, true);
+		}
+		if (benchmark.started())
+			benchmark.apply(camera, explicitLod, terrainTimer);
+
+		glActiveTexture(GL_TEXTURE6);
+		bool horizonBaked = horizon.update();
+		glActiveTexture(GL_TEXTURE0);
+		if (horizonBaked)
+			std::cout << "Horizon map: " << horizon.tileCount() << " tiles baked after " << loader.secondsSinceStart() * 1000.0 << " ms" << std::endl;
+
+		// from the camera the frame is drawn with, on its own thread while the rest of the frame gets set up, only the
+		// draw waits for it
+		bool horizonCulling = horizonCull && frustumCull && boundsTexture && !mosaicMode && (renderMode == RENDER_INDEXED || renderMode == RENDER_VERTEX_ID);
+		if (horizonCulling)
+			horizonCuller.start(loader.pyramid(), PatchRez, glm::vec2((float)width, (float)height), camera.Position);
+
+		// draw into the offscreen target, nothing but the UI while minimized
+		profiler.begin(PASS_TERRAIN);
+		bool drawScene = sceneTarget.bind();
+		int viewportWidth = sceneTarget.width(), viewportHeight = sceneTarget.height();
+
 		// clear buffers
 		glClearColor(0.1f, 0.1f, 0.1f, 1.0f);
 		glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
@@ -228,28 +477,300 @@ int main()
 		// activate shader before drawing and uniforms
 		HeightShader.use();
 
-		glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), ((float)WIDTH / (float)HEIGHT), 0.1f, 100000.0f);
+		// the aspect of the window, the target has the same one at any scale
+		float aspect = sceneTarget.nativeHeight() > 0 ? (float)sceneTarget.nativeWidth() / (float)sceneTarget.nativeHeight() : (float)WIDTH / (float)HEIGHT;
+		glm::mat4 projection = glm::perspective(glm::radians(camera.Zoom), aspect, 0.1f, 100000.0f);
 		glm::mat4 view = camera.GetViewMatrix();
 		glm::mat4 model = glm::mat4(1.0f);
-		HeightShader.setMat4("projection", projection);
-		HeightShader.setMat4("view", view);
-		HeightShader.setMat4("model", model);
+		Frustum frustum = extractFrustum(projection * view * model);
+
+		FrameConstants constants;
+		constants.Projection = projection;
+		constants.View = view;
+		constants.Model = model;
+		constants.ModelView = view * model;
+		constants.ModelViewProjection = projection * constants.ModelView;
+		std::copy(std::begin(frustum.Planes), std::end(frustum.Planes), constants.FrustumPlanes);
+		constants.CameraPos = camera.Position;
+		constants.ViewportSize = glm::vec2((float)viewportWidth, (float)viewportHeight);
+		frameUniforms.update(constants);
+
+		float pixelsPerUnit = projection[1][1] * 0.5f * (float)viewportHeight;
+		if (streamer.enabled())
+		{
+			// look ahead along the flight so fast moves find their tiles already loaded
+			cameraMotion.update(camera, deltaTime);
+			std::vector<TileView> predicted;
+			if (cameraMotion.moving())
+			{
+				for (int i = 1; i <= PREFETCH_STEPS; i++)
+				{
+					float t = PrefetchSeconds * i / PREFETCH_STEPS;
+					predicted.push_back({ cameraMotion.predictPosition(camera, t), extractFrustum(projection * cameraMotion.predictView(camera, t) * model) });
+				}
+			}
+			streamer.update({ camera.Position, frustum }, predicted, pixelsPerUnit);
+		}
 
-		// render heightmap
-		glBindVertexArray(terrainVAO);
-		glDrawArrays(GL_PATCHES, 0, NUM_PATCH_PTS* rez* rez);
+		HeightShader.setInt("tessMode", tessMode);
+		HeightShader.setFloat("triangleSize", TriangleSize);
+		HeightShader.setInt("explicitLod", explicitLod);
+		HeightShader.setInt("useLighting", useLighting && (normalTexture || mosaicMode));
+		HeightShader.setInt("useHorizon", useHorizon && horizon.started() && !mosaicMode);
+		float azimuth = glm::radians(SunAzimuth), elevation = glm::radians(SunElevation);
+		HeightShader.setVec3("sunDirection", std::cos(azimuth) * std::cos(elevation), std::sin(elevation), std::sin(azimuth) * std::cos(elevation));
+		HeightShader.setFloat("lodBias", LodBias);
+		HeightShader.setInt("useRoughness", useRoughness && roughnessTexture && !mosaicMode);
+		HeightShader.setFloat("roughnessTolerance", RoughnessTolerance);
+
+		// the quadtree culls whole nodes itself
+		bool patchCull = frustumCull && boundsTexture && renderMode != RENDER_QUADTREE;
+		HeightShader.setInt("frustumCull", patchCull);
+		// the pyramid only helps with solid polygons, wireframe leaves the depth buffer mostly empty
+		bool patchOcclusion = patchCull && occlusionCull && !wireframe && !mosaicMode;
+		HeightShader.setInt("occlusionCull", patchOcclusion && hiz.valid());
+		HeightShader.setMat4("hizViewProjection", hiz.viewProjection());
+
+		// render heightmap, imgui switches back to filled polygons for itself
+		glPolygonMode(GL_FRONT_AND_BACK, wireframe ? GL_LINE : GL_FILL);
+		HeightShader.setInt("renderMode", mosaicMode ? RENDER_VERTEX_ID : renderMode);
+		HeightShader.setInt("patchRez", PatchRez);
+		// only frames that draw the terrain are timed, empty ones (minimized, still loading) would read as near zero
+		// and drive both budgets to their maximum
+		bool drawTerrain = drawScene && (mosaicMode || uploader.ready());
+		if (drawTerrain && terrainTimer.begin())
+		{
+			if (benchmark.started())
+				benchmark.record(terrainTimer);
+			else
+			{
+				tessBudget.update(terrainTimer);
+				sceneTarget.update(terrainTimer);
+			}
+		}
+		// the benchmark measures the levels as they are
+		float tessMultiplier = benchmark.started() ? 1.0f : tessBudget.Multiplier;
+		HeightShader.setFloat("tessMultiplier", tessMultiplier);
+		patchCounter.begin();
+		if (!drawScene)
+		{
+			// minimized
+		}
+		else if (mosaicMode)
+		{
+			glBindVertexArray(emptyVAO);
+			glActiveTexture(GL_TEXTURE0);
+			sheetsDrawn = 0;
+			for (const MosaicSheet& sheet : sheets)
+			{
+				glm::vec2 half(sheet.Cells * 0.5f, sheet.Rows * 0.5f);
+				if (!frustum.intersectsBox(glm::vec3(sheet.Center.x - half.x, sheet.Map.MinHeight, sheet.Center.y - half.y),
+					glm::vec3(sheet.Center.x + half.x, sheet.Map.MaxHeight, sheet.Center.y + half.y)))
+					continue;
+				glActiveTexture(GL_TEXTURE5);
+				glBindTexture(GL_TEXTURE_2D, sheet.NormalTexture);
+				glActiveTexture(GL_TEXTURE0);
+				glBindTexture(GL_TEXTURE_2D, sheet.Texture);
+				HeightShader.setFloat("heightScale", sheet.Map.Scale);
+				HeightShader.setFloat("heightOffset", sheet.Map.Offset);
+				HeightShader.setVec2("terrainSize", (float)sheet.Cells, (float)sheet.Rows);
+				HeightShader.setVec2("sheetOffset", sheet.Center.x, sheet.Center.y);
+				// the sheet edges sit on the centres of the first and the shared last sample
+				HeightShader.setVec2("uvScale", sheet.Cells / (sheet.Cells + 1.0f), sheet.Rows / (sheet.Rows + 1.0f));
+				HeightShader.setVec2("uvOffset", 0.5f / (sheet.Cells + 1.0f), 0.5f / (sheet.Rows + 1.0f));
+				glDrawArrays(GL_PATCHES, 0, NUM_PATCH_PTS * PatchRez * PatchRez);
+				sheetsDrawn++;
+			}
+		}
+		else if (!uploader.ready())
+		{
+			// nothing to sample yet
+		}
+		else if (renderMode == RENDER_QUADTREE)
+		{
+			if (quadtree.select(camera.Position, frustum, pixelsPerUnit, TriangleSize / tessMultiplier))
+			{
+				const std::vector<QuadtreeInstance>& nodes = quadtree.selection();
+				glBindBuffer(GL_ARRAY_BUFFER, quadtreeVBO);
+				glBufferData(GL_ARRAY_BUFFER, nodes.size() * sizeof(QuadtreeInstance), nodes.data(), GL_STREAM_DRAW);
+				quadtreeInstances = (GLsizei)nodes.size();
+			}
+			HeightShader.setVec2Array("morphRanges", quadtree.morphRanges().data(), quadtree.lodCount());
+			glBindVertexArray(quadtreeVAO);
+			glDrawArraysInstanced(GL_PATCHES, 0, NUM_PATCH_PTS * QUADTREE_NODE_PATCHES * QUADTREE_NODE_PATCHES, quadtreeInstances);
+		}
+		else if (renderMode == RENDER_GPU_CULLED)
+		{
+			gpuCuller.cull(CullShader, loader.pyramid(), PatchRez, glm::vec2((float)width, (float)height), TriangleSize / tessMultiplier, frustumCull);
+			HeightShader.use();
+			glBindVertexArray(emptyVAO);
+			gpuCuller.draw();
+		}
+		else if (renderMode == RENDER_INDEXED)
+		{
+			if (gridRez != (unsigned int)PatchRez)
+				uploadPatchGrid(PatchRez);
+			glBindVertexArray(terrainVAO);
+			if (horizonCulling)
+			{
+				// runs of visible patches as ranges of the index buffer
+				horizonCuller.finish();
+				const std::vector<GLint>& first = horizonCuller.runFirst();
+				const std::vector<GLsizei>& count = horizonCuller.runCount();
+				cullerOffsets.resize(first.size());
+				cullerCounts.resize(first.size());
+				for (size_t r = 0; r < first.size(); r++)
+				{
+					cullerOffsets[r] = (const void*)((size_t)first[r] * NUM_PATCH_PTS * sizeof(GLuint));
+					cullerCounts[r] = count[r] * NUM_PATCH_PTS;
+				}
+				glMultiDrawElements(GL_PATCHES, cullerCounts.data(), GL_UNSIGNED_INT, cullerOffsets.data(), (GLsizei)first.size());
+			}
+			else
+				glDrawElements(GL_PATCHES, gridIndexCount, GL_UNSIGNED_INT, 0);
+		}
+		else
+		{
+			glBindVertexArray(emptyVAO);
+			if (horizonCulling)
+			{
+				// gl_VertexID still counts from the start of the grid, so a run is drawn at its place in it
+				horizonCuller.finish();
+				const std::vector<GLint>& first = horizonCuller.runFirst();
+				const std::vector<GLsizei>& count = horizonCuller.runCount();
+				cullerFirsts.resize(first.size());
+				cullerCounts.resize(first.size());
+				for (size_t r = 0; r < first.size(); r++)
+				{
+					cullerFirsts[r] = first[r] * NUM_PATCH_PTS;
+					cullerCounts[r] = count[r] * NUM_PATCH_PTS;
+				}
+				glMultiDrawArrays(GL_PATCHES, cullerFirsts.data(), cullerCounts.data(), (GLsizei)first.size());
+			}
+			else
+				glDrawArrays(GL_PATCHES, 0, NUM_PATCH_PTS * PatchRez * PatchRez);
+		}
+		// still running when the upload wasn't ready, it is not left working on a stale job
+		if (horizonCulling)
+			horizonCuller.finish();
+		patchCounter.end();
+		if (drawTerrain)
+			terrainTimer.end();
+		if (drawScene && patchOcclusion && uploader.ready())
+			hiz.build(HiZShader, viewportWidth, viewportHeight, constants.ModelViewProjection);
+		else
+			hiz.invalidate();
+		frameUniforms.endFrame();
+		if (drawScene)
+			sceneTarget.present();
+		profiler.end(PASS_TERRAIN);
+		if (benchmark.finished())
+		{
+			benchmark.report("benchmark.csv");
+			glfwSetWindowShouldClose(window, true);
+		}
 
 
 		// Start the Dear ImGui frame
+		profiler.begin(PASS_IMGUI);
 		ImGui_ImplOpenGL3_NewFrame();
 		ImGui_ImplGlfw_NewFrame();
 		ImGui::NewFrame();
-		ImGui::SetNextWindowSize(ImVec2(300, 180));
+		// zero height lets the window fit its contents
+		ImGui::SetNextWindowSize(ImVec2(300, 0));
 		ImGui::Begin("Settings");
 		ImGui::PushItemWidth(120);
 		ImGui::SliderFloat("Camera Movement Speed", &CameraMovementSpeed, 100.f, 200.f);
 		if (camera.MovementSpeed != CameraMovementSpeed)
 			camera.MovementSpeed = CameraMovementSpeed;
+		if (!mosaicMode)
+			ImGui::Combo("Render Mode", &renderMode, quadtree.empty() ? "Indexed grid\0Vertex ID\0" : "Indexed grid\0Vertex ID\0Quadtree\0GPU culled (indirect)\0");
+		if (renderMode == RENDER_QUADTREE)
+		{
+			// lod and tessellation both follow from the quadtree selection
+			ImGui::SliderFloat("Triangle size (px)", &TriangleSize, 2.f, 64.f);
+			ImGui::Text("Nodes: %d drawn, %d culled, %d lods", quadtree.Selected, quadtree.Culled, quadtree.lodCount());
+		}
+		else
+		{
+			if (ImGui::SliderInt("Patches per side", &PatchRez, 1, 256) && boundsTexture)
+				horizonCuller.prepare(loader.pyramid(), PatchRez);
+			ImGui::Combo("Tessellation", &tessMode, "Distance\0Screen space\0");
+			if (tessMode == TESS_SCREEN_SPACE)
+				ImGui::SliderFloat("Triangle size (px)", &TriangleSize, 2.f, 64.f);
+		}
+		if (roughnessTexture && renderMode != RENDER_QUADTREE)
+		{
+			ImGui::Checkbox("Roughness aware", &useRoughness);
+			if (useRoughness)
+				ImGui::SliderFloat("Full detail error (m)", &RoughnessTolerance, 0.05f, 10.f);
+		}
+		if (boundsTexture && renderMode != RENDER_QUADTREE)
+			ImGui::Checkbox("Frustum culling", &frustumCull);
+		if (boundsTexture && renderMode != RENDER_QUADTREE && frustumCull)
+			ImGui::Checkbox("Occlusion culling (Hi-Z)", &occlusionCull);
+		if (boundsTexture && (renderMode == RENDER_INDEXED || renderMode == RENDER_VERTEX_ID) && frustumCull && !mosaicMode)
+		{
+			ImGui::Checkbox("Horizon culling (CPU)", &horizonCull);
+			if (horizonCull)
+				ImGui::Text("Horizon culler: %d of %d patches hidden, %.3f ms", horizonCuller.Hidden, horizonCuller.Patches, horizonCuller.Milliseconds);
+		}
+		ImGui::Text("Patches drawn: %u, culled: %u, occluded: %u", patchCounter.Drawn, patchCounter.Culled, patchCounter.Occluded);
+		ImGui::Checkbox("Wireframe", &wireframe);
+		ImGui::Checkbox("Lighting", &useLighting);
+		if (useLighting)
+		{
+			ImGui::SliderFloat("Sun azimuth", &SunAzimuth, 0.f, 360.f);
+			ImGui::SliderFloat("Sun elevation", &SunElevation, 0.f, 90.f);
+			if (horizon.started())
+			{
+				ImGui::Checkbox("Shadows and AO", &useHorizon);
+				if (!horizon.done())
+					ImGui::Text("Baking horizons: %d of %d tiles", horizon.BakedTiles, horizon.tileCount());
+			}
+		}
+		ImGui::Checkbox("Explicit height LOD", &explicitLod);
+		if (explicitLod)
+			ImGui::SliderFloat("Height LOD bias", &LodBias, -2.f, 2.f);
+		ImGui::Text("Terrain GPU time: %.2f ms", terrainTimer.Milliseconds);
+		if (ImGui::Checkbox("GPU time budget", &tessBudget.Enabled) && tessBudget.Enabled)
+			sceneTarget.Adaptive = false;
+		if (tessBudget.Enabled)
+			ImGui::SliderFloat("Budget (ms)", &tessBudget.Controller.TargetMilliseconds, 1.f, 33.f);
+		ImGui::Text("Tessellation scale: %.3f", tessBudget.Multiplier);
+		// both budgets follow the terrain GPU time, one at a time so they don't chase each other
+		if (ImGui::Checkbox("Dynamic resolution", &sceneTarget.Adaptive) && sceneTarget.Adaptive)
+			tessBudget.Enabled = false;
+		if (sceneTarget.Adaptive)
+			ImGui::SliderFloat("Resolution budget (ms)", &sceneTarget.Controller.TargetMilliseconds, 1.f, 33.f);
+		else
+			ImGui::SliderFloat("Render scale", &sceneTarget.Scale, sceneTarget.Controller.MinValue, sceneTarget.Controller.MaxValue);
+		ImGui::Text("Render resolution: %dx%d of %dx%d", sceneTarget.width(), sceneTarget.height(), sceneTarget.nativeWidth(), sceneTarget.nativeHeight());
+		if (streamer.enabled())
+		{
+			ImGui::SliderFloat("Tile sample size (px)", &streamer.TargetError, 0.25f, 8.f);
+			ImGui::Text("Tiles: %d wanted, %d/%d pages, %d cached", streamer.Wanted, streamer.Resident, streamer.PoolPages, (int)streamer.cachedTiles());
+			ImGui::SliderFloat("Prefetch ahead (s)", &PrefetchSeconds, 0.f, 2.f);
+			ImGui::Text("Tiles queued: %d, uploaded: %d, prefetching: %d", streamer.Queued, streamer.Uploaded, streamer.Prefetched);
+			ImGui::Text("Stale requests cancelled: %d", streamer.Cancelled);
+		}
+		if (mosaicMode)
+		{
+			if (mosaicLoader.failed())
+				ImGui::Text("Failed to load the mosaic");
+			else if (!mosaicLoader.done())
+				ImGui::Text("Loading mosaic...");
+			else
+				ImGui::Text("Mosaic sheets: %d drawn of %d", sheetsDrawn, (int)sheets.size());
+		}
+		else if (loader.failed())
+			ImGui::Text("Failed to load the heightmap");
+		else if (!texture)
+			ImGui::Text("Loading...");
+		else if (uploader.residentLevel() > 0 || uploader.busy())
+			ImGui::Text("Loading: level %d of %d", uploader.residentLevel(), terrainInfo.LevelCount - terrainInfo.FirstLevel);
+		else if (!boundsTexture)
+			ImGui::Text("Building roughness and culling data...");
 		ImGui::Text("Camera Position & Rotation");
 		ImGui::Text("X: %.2f", camera.Position.x);
 		ImGui::Text("Z: %.2f", camera.Position.z);
@@ -259,19 +780,45 @@ int main()
 		ImGui::Text("Pitch: %.2f", camera.Pitch);
 
 		ImGui::End();
+		profiler.draw();
 		ImGui::Render();
 		ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
+		profiler.end(PASS_IMGUI);
 
 		// swap
+		profiler.begin(PASS_SWAP);
 		glfwSwapBuffers(window);
 		glfwPollEvents();
+		profiler.end(PASS_SWAP);
 
 	}
 
 	// delete all used sources
 	glDeleteVertexArrays(1, &terrainVAO);
+	glDeleteVertexArrays(1, &emptyVAO);
+	glDeleteVertexArrays(1, &quadtreeVAO);
+	glDeleteBuffers(1, &quadtreeVBO);
 	glDeleteBuffers(1, &terrainVBO);
 	glDeleteBuffers(1, &terrainEBO);
+	glDeleteTextures(1, &texture);
+	glDeleteTextures(1, &roughnessTexture);
+	glDeleteTextures(1, &boundsTexture);
+	glDeleteTextures(1, &normalTexture);
+	horizon.destroy();
+	for (const MosaicSheet& sheet : sheets)
+	{
+		glDeleteTextures(1, &sheet.Texture);
+		glDeleteTextures(1, &sheet.NormalTexture);
+	}
+	uploader.destroy();
+	streamer.destroy();
+	patchCounter.destroy();
+	terrainTimer.destroy();
+	profiler.destroy();
+	hiz.destroy();
+	gpuCuller.destroy();
+	sceneTarget.destroy();
+	frameUniforms.destroy();
 
 	glfwTerminate();
 
@@ -308,6 +855,8 @@ void processInput(GLFWwindow* window)
 void framebuffer_size_callback(GLFWwindow* window, int width, int height)
 {
 	glViewport(0, 0, width, height);
+	// the offscreen target follows on its next bind
+	sceneTarget.resize(width, height);
 }
 
 /*void key_callback(GLFWwindow* window, int key, int scancode, int action, int modifiers)
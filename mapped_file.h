@@ -0,0 +1,126 @@
+#ifndef MAPPED_FILE_H
+#define MAPPED_FILE_H
+
+#include <cstddef>
+#include <iostream>
+
+#ifdef _WIN32
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// read only memory mapping of a whole file, pages are faulted in by the OS on first access
+class MappedFile
+{
+public:
+	MappedFile() {}
+	~MappedFile()
+	{
+		close();
+	}
+	MappedFile(const MappedFile&) = delete;
+	MappedFile& operator=(const MappedFile&) = delete;
+
+	bool open(const char* path)
+	{
+		close();
+#ifdef _WIN32
+		File = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_RANDOM_ACCESS, nullptr);
+		if (File == INVALID_HANDLE_VALUE)
+			return false;
+		LARGE_INTEGER fileSize;
+		if (!GetFileSizeEx(File, &fileSize) || fileSize.QuadPart == 0)
+		{
+			close();
+			return false;
+		}
+		Mapping = CreateFileMappingA(File, nullptr, PAGE_READONLY, 0, 0, nullptr);
+		if (!Mapping)
+		{
+			close();
+			return false;
+		}
+		Data = (const unsigned char*)MapViewOfFile(Mapping, FILE_MAP_READ, 0, 0, 0);
+		Size = (size_t)fileSize.QuadPart;
+#else
+		File = ::open(path, O_RDONLY);
+		if (File < 0)
+			return false;
+		struct stat st;
+		if (fstat(File, &st) != 0 || st.st_size == 0)
+		{
+			close();
+			return false;
+		}
+		void* mapping = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, File, 0);
+		Data = mapping == MAP_FAILED ? nullptr : (const unsigned char*)mapping;
+		Size = (size_t)st.st_size;
+#endif
+		if (!Data)
+		{
+			std::cout << "ERROR::MAPPED_FILE::MAP_FAILED " << path << std::endl;
+			close();
+			return false;
+		}
+		return true;
+	}
+
+	void close()
+	{
+#ifdef _WIN32
+		if (Data)
+			UnmapViewOfFile(Data);
+		if (Mapping)
+			CloseHandle(Mapping);
+		if (File != INVALID_HANDLE_VALUE)
+			CloseHandle(File);
+		Mapping = nullptr;
+		File = INVALID_HANDLE_VALUE;
+#else
+		if (Data)
+			munmap((void*)Data, Size);
+		if (File >= 0)
+			::close(File);
+		File = -1;
+#endif
+		Data = nullptr;
+		Size = 0;
+	}
+
+	bool isOpen() const
+	{
+		return Data != nullptr;
+	}
+
+	const unsigned char* data() const
+	{
+		return Data;
+	}
+
+	size_t size() const
+	{
+		return Size;
+	}
+
+private:
+#ifdef _WIN32
+	HANDLE File = INVALID_HANDLE_VALUE;
+	HANDLE Mapping = nullptr;
+#else
+	int File = -1;
+#endif
+	const unsigned char* Data = nullptr;
+	size_t Size = 0;
+};
+
+#endif
@@ -0,0 +1,142 @@
+#ifndef NORMAL_MAP_H
+#define NORMAL_MAP_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include "heightmap.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+// surface normals of a heightmap, one per sample, built once at load time so lighting is a single fetch instead of
+// four neighbouring heights. stored as the x and z components in signed bytes (RG8_SNORM), y is always up and
+// follows from the other two
+struct NormalMap
+{
+	int Width = 0;
+	int Height = 0;
+	std::vector<int8_t> Data;
+};
+
+// rows of sobel output between band boundaries
+const int NORMAL_BAND_ROWS = 64;
+
+// sobel gradient at x of three consecutive rows, edges clamped, written as snorm (x, z)
+inline void sobelNormal(const float* r0, const float* r1, const float* r2, int width, int x, float scaleX, float scaleZ, int8_t* out)
+{
+	int xl = std::max(x - 1, 0), xr = std::min(x + 1, width - 1);
+	float gx = (r0[xr] - r0[xl]) + 2.0f * (r1[xr] - r1[xl]) + (r2[xr] - r2[xl]);
+	float gz = (r2[xl] + 2.0f * r2[x] + r2[xr]) - (r0[xl] + 2.0f * r0[x] + r0[xr]);
+	float nx = -gx * scaleX, nz = -gz * scaleZ;
+	float inv = 1.0f / std::sqrt(nx * nx + 1.0f + nz * nz);
+	out[0] = (int8_t)std::lround(nx * inv * 127.0f);
+	out[1] = (int8_t)std::lround(nz * inv * 127.0f);
+}
+
+#ifdef HR_SSE2
+// 4 normals from their scaled gradients, interleaved to 8 snorm bytes
+inline void storeNormals4(__m128 nx, __m128 nz, int8_t* out)
+{
+	__m128 length = _mm_sqrt_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(nx, nx), _mm_mul_ps(nz, nz)), _mm_set1_ps(1.0f)));
+	__m128 scale = _mm_div_ps(_mm_set1_ps(127.0f), length);
+	// rounds to nearest like lround, up to ties
+	__m128i ix = _mm_cvtps_epi32(_mm_mul_ps(nx, scale));
+	__m128i iz = _mm_cvtps_epi32(_mm_mul_ps(nz, scale));
+	// x0..x3 z0..z3 as int16, then interleaved and narrowed to bytes
+	__m128i packed = _mm_packs_epi32(ix, iz);
+	__m128i pairs = _mm_unpacklo_epi16(packed, _mm_srli_si128(packed, 8));
+	_mm_storel_epi64((__m128i*)out, _mm_packs_epi16(pairs, pairs));
+}
+#endif
+
+// one row of normals from the rows above, at and below it
+inline void sobelRow(const float* r0, const float* r1, const float* r2, int width, float scaleX, float scaleZ, int8_t* out)
+{
+	sobelNormal(r0, r1, r2, width, 0, scaleX, scaleZ, out);
+	int x = 1;
+#if defined(HR_AVX2)
+	__m256 two8 = _mm256_set1_ps(2.0f), sx8 = _mm256_set1_ps(-scaleX), sz8 = _mm256_set1_ps(-scaleZ);
+	for (; x + 8 < width; x += 8)
+	{
+		__m256 l0 = _mm256_loadu_ps(r0 + x - 1), c0 = _mm256_loadu_ps(r0 + x), h0 = _mm256_loadu_ps(r0 + x + 1);
+		__m256 l1 = _mm256_loadu_ps(r1 + x - 1), h1 = _mm256_loadu_ps(r1 + x + 1);
+		__m256 l2 = _mm256_loadu_ps(r2 + x - 1), c2 = _mm256_loadu_ps(r2 + x), h2 = _mm256_loadu_ps(r2 + x + 1);
+		__m256 gx = _mm256_add_ps(_mm256_add_ps(_mm256_sub_ps(h0, l0), _mm256_sub_ps(h2, l2)), _mm256_mul_ps(two8, _mm256_sub_ps(h1, l1)));
+		__m256 below = _mm256_add_ps(_mm256_add_ps(l2, h2), _mm256_mul_ps(two8, c2));
+		__m256 above = _mm256_add_ps(_mm256_add_ps(l0, h0), _mm256_mul_ps(two8, c0));
+		__m256 nx = _mm256_mul_ps(gx, sx8), nz = _mm256_mul_ps(_mm256_sub_ps(below, above), sz8);
+		// SSE2 packs work on the halves anyway
+		storeNormals4(_mm256_castps256_ps128(nx), _mm256_castps256_ps128(nz), out + x * 2);
+		storeNormals4(_mm256_extractf128_ps(nx, 1), _mm256_extractf128_ps(nz, 1), out + x * 2 + 8);
+	}
+#elif defined(HR_SSE2)
+	__m128 two = _mm_set1_ps(2.0f), sx = _mm_set1_ps(-scaleX), sz = _mm_set1_ps(-scaleZ);
+	for (; x + 4 < width; x += 4)
+	{
+		__m128 l0 = _mm_loadu_ps(r0 + x - 1), c0 = _mm_loadu_ps(r0 + x), h0 = _mm_loadu_ps(r0 + x + 1);
+		__m128 l1 = _mm_loadu_ps(r1 + x - 1), h1 = _mm_loadu_ps(r1 + x + 1);
+		__m128 l2 = _mm_loadu_ps(r2 + x - 1), c2 = _mm_loadu_ps(r2 + x), h2 = _mm_loadu_ps(r2 + x + 1);
+		__m128 gx = _mm_add_ps(_mm_add_ps(_mm_sub_ps(h0, l0), _mm_sub_ps(h2, l2)), _mm_mul_ps(two, _mm_sub_ps(h1, l1)));
+		__m128 below = _mm_add_ps(_mm_add_ps(l2, h2), _mm_mul_ps(two, c2));
+		__m128 above = _mm_add_ps(_mm_add_ps(l0, h0), _mm_mul_ps(two, c0));
+		storeNormals4(_mm_mul_ps(gx, sx), _mm_mul_ps(_mm_sub_ps(below, above), sz), out + x * 2);
+	}
+#endif
+	for (; x < width; x++)
+		sobelNormal(r0, r1, r2, width, x, scaleX, scaleZ, out + x * 2);
+}
+
+// sobel normals of the whole map in bands of rows on the pool. spacing is the distance between samples in model
+// units, heights are in meters, so the normals are in model space
+inline NormalMap buildNormalMap(const Heightmap& map, float spacingX, float spacingZ, ThreadPool& pool)
+{
+	NormalMap normals;
+	normals.Width = map.Width;
+	normals.Height = map.Height;
+	normals.Data.resize((size_t)map.Width * map.Height * 2);
+	if (map.Width == 0 || map.Height == 0)
+		return normals;
+	// the sobel weights add up to 8 across the two sample steps
+	float scaleX = 1.0f / (8.0f * spacingX);
+	float scaleZ = 1.0f / (8.0f * spacingZ);
+
+	int bands = (map.Height + NORMAL_BAND_ROWS - 1) / NORMAL_BAND_ROWS;
+	pool.parallelFor(bands, [&](size_t band) {
+		int y0 = (int)band * NORMAL_BAND_ROWS, y1 = std::min(y0 + NORMAL_BAND_ROWS, map.Height);
+		// rolling window of three converted rows, the map edge repeats its last row
+		std::vector<float> rows[3] = { std::vector<float>(map.Width), std::vector<float>(map.Width), std::vector<float>(map.Width) };
+		map.rowToMeters(std::max(y0 - 1, 0), 0, map.Width, rows[0].data());
+		map.rowToMeters(y0, 0, map.Width, rows[1].data());
+		for (int y = y0; y < y1; y++)
+		{
+			map.rowToMeters(std::min(y + 1, map.Height - 1), 0, map.Width, rows[2].data());
+			sobelRow(rows[0].data(), rows[1].data(), rows[2].data(), map.Width, scaleX, scaleZ, &normals.Data[(size_t)y * map.Width * 2]);
+			std::swap(rows[0], rows[1]);
+			std::swap(rows[1], rows[2]);
+		}
+	});
+	return normals;
+}
+
+// RG8_SNORM with GL generated mipmaps, filtered like the heightmap
+inline GLuint createNormalTexture(const NormalMap& normals)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 2);
+	glTexStorage2D(GL_TEXTURE_2D, mipLevelCount(normals.Width, normals.Height), GL_RG8_SNORM, normals.Width, normals.Height);
+	glTexSubImage2D(GL_TEXTURE_2D, 0, 0, 0, normals.Width, normals.Height, GL_RG, GL_BYTE, normals.Data.data());
+	glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	glGenerateMipmap(GL_TEXTURE_2D);
+	return texture;
+}
+
+#endif
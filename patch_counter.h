@@ -0,0 +1,90 @@
+#ifndef PATCH_COUNTER_H
+#define PATCH_COUNTER_H
+
+#include <glad/glad.h>
+
+// culled, drawn and occluded patch counts written by the TCS into an atomic counter buffer
+// every frame gets its own buffer out of a small ring and is only read back once its fence has passed,
+// so the numbers lag a few frames behind but the CPU never waits for the GPU
+class PatchCounter
+{
+public:
+	static const int FRAMES = 4;
+	// atomic counter binding used by the TCS
+	static const GLuint BINDING = 0;
+
+	GLuint Culled = 0;
+	GLuint Drawn = 0;
+	GLuint Occluded = 0;
+
+	void init()
+	{
+		glGenBuffers(FRAMES, Buffers);
+		for (int i = 0; i < FRAMES; i++)
+		{
+			glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, Buffers[i]);
+			glBufferData(GL_ATOMIC_COUNTER_BUFFER, 3 * sizeof(GLuint), nullptr, GL_DYNAMIC_READ);
+		}
+		glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, 0);
+	}
+
+	void destroy()
+	{
+		for (int i = 0; i < FRAMES; i++)
+			if (Fences[i])
+				glDeleteSync(Fences[i]);
+		glDeleteBuffers(FRAMES, Buffers);
+	}
+
+	// zero this frame's counters and bind them, call before the terrain draw
+	void begin()
+	{
+		collect();
+		if (Fences[Current])
+		{
+			// still in flight, its numbers are skipped
+			glDeleteSync(Fences[Current]);
+			Fences[Current] = 0;
+		}
+		const GLuint zero[3] = { 0, 0, 0 };
+		glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, Buffers[Current]);
+		glBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(zero), zero);
+		glBindBufferBase(GL_ATOMIC_COUNTER_BUFFER, BINDING, Buffers[Current]);
+	}
+
+	// call after the terrain draw
+	void end()
+	{
+		Fences[Current] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+		Current = (Current + 1) % FRAMES;
+	}
+
+private:
+	GLuint Buffers[FRAMES] = {};
+	GLsync Fences[FRAMES] = {};
+	int Current = 0;
+
+	// newest finished frame wins, older ones are dropped
+	void collect()
+	{
+		for (int age = FRAMES; age >= 1; age--)
+		{
+			int slot = (Current + FRAMES - age) % FRAMES;
+			if (!Fences[slot])
+				continue;
+			GLenum status = glClientWaitSync(Fences[slot], 0, 0);
+			if (status != GL_ALREADY_SIGNALED && status != GL_CONDITION_SATISFIED)
+				continue;
+			GLuint counts[3];
+			glBindBuffer(GL_ATOMIC_COUNTER_BUFFER, Buffers[slot]);
+			glGetBufferSubData(GL_ATOMIC_COUNTER_BUFFER, 0, sizeof(counts), counts);
+			Culled = counts[0];
+			Drawn = counts[1];
+			Occluded = counts[2];
+			glDeleteSync(Fences[slot]);
+			Fences[slot] = 0;
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef PATCH_GRID_H
+#define PATCH_GRID_H
+
+#include <cstddef>
+#include <vector>
+
+// floats per grid vertex: x, y, z, u, v
+const unsigned int PATCH_GRID_STRIDE = 5;
+
+// rez x rez quad patches centred on the origin in the xz plane, for GL_PATCHES with 4 control points
+// corners are shared by the neighbouring patches, so there are (rez + 1)^2 vertices and 4 indices per patch
+// patch corners are ordered top left, top right, bottom left, bottom right like the shaders expect
+struct PatchGrid
+{
+	unsigned int Rez = 0;
+	std::vector<float> Vertices;
+	std::vector<unsigned int> Indices;
+
+	size_t vertexCount() const
+	{
+		return Vertices.size() / PATCH_GRID_STRIDE;
+	}
+
+	size_t patchCount() const
+	{
+		return Indices.size() / 4;
+	}
+};
+
+inline PatchGrid buildPatchGrid(unsigned int rez, float width, float height)
+{
+	PatchGrid grid;
+	grid.Rez = rez;
+	unsigned int side = rez + 1;
+	grid.Vertices.reserve((size_t)side * side * PATCH_GRID_STRIDE);
+	grid.Indices.reserve((size_t)rez * rez * 4);
+
+	// vertex (i, j) lives at index j * side + i
+	for (unsigned int j = 0; j <= rez; j++)
+	{
+		for (unsigned int i = 0; i <= rez; i++)
+		{
+			grid.Vertices.push_back(-width / 2.0f + width * i / (float)rez); // v.x
+			grid.Vertices.push_back(0.0f); // v.y
+			grid.Vertices.push_back(-height / 2.0f + height * j / (float)rez); // v.z
+			grid.Vertices.push_back(i / (float)rez); // u
+			grid.Vertices.push_back(j / (float)rez); // v
+		}
+	}
+
+	// same patch order as the old per patch vertex list: i outer, j inner
+	for (unsigned int i = 0; i < rez; i++)
+	{
+		for (unsigned int j = 0; j < rez; j++)
+		{
+			grid.Indices.push_back(j * side + i);           // top left
+			grid.Indices.push_back(j * side + i + 1);       // top right
+			grid.Indices.push_back((j + 1) * side + i);     // bottom left
+			grid.Indices.push_back((j + 1) * side + i + 1); // bottom right
+		}
+	}
+	return grid;
+}
+
+#endif
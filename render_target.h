@@ -0,0 +1,134 @@
+#ifndef RENDER_TARGET_H
+#define RENDER_TARGET_H
+
+#include <cmath>
+#include <iostream>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include "gpu_timer.h"
+#include "tess_budget.h"
+
+// texture unit the attachments are bound to while they are created, so none of the terrain's bindings move
+const int RENDER_TARGET_UNIT = 9;
+
+// offscreen color and depth target the scene is drawn into at a fraction of the window resolution, then stretched
+// over the window so the UI can go on top at native resolution.
+// the fraction follows the terrain's GPU time towards a target like TessBudget does with the tessellation, in coarse
+// steps so the target isn't reallocated over a pixel or two
+class RenderTarget
+{
+public:
+	bool Adaptive = false;
+	BudgetController Controller{ 0.5f, 1.0f, 0.85f, 1.05f, 1.0f / 32.0f };
+	// fraction of the window resolution per axis
+	float Scale = 1.0f;
+
+	// size of the window framebuffer, from the resize callback
+	void resize(int width, int height)
+	{
+		NativeWidth = width;
+		NativeHeight = height;
+	}
+
+	int nativeWidth() const
+	{
+		return NativeWidth;
+	}
+
+	int nativeHeight() const
+	{
+		return NativeHeight;
+	}
+
+	// size the scene is drawn at this frame, valid after bind()
+	int width() const
+	{
+		return Width;
+	}
+
+	int height() const
+	{
+		return Height;
+	}
+
+	void destroy()
+	{
+		glDeleteFramebuffers(1, &Framebuffer);
+		glDeleteTextures(1, &Color);
+		glDeleteTextures(1, &Depth);
+		Framebuffer = Color = Depth = 0;
+		Width = Height = 0;
+	}
+
+	// call whenever the terrain timer has a new measurement
+	void update(const GpuTimer& timer)
+	{
+		if (Adaptive)
+			Controller.update(timer, Scale);
+	}
+
+	// binds the target at the current scale, (re)allocated when the size changed. false while the window is minimized
+	bool bind()
+	{
+		if (NativeWidth <= 0 || NativeHeight <= 0)
+			return false;
+		int width = std::max(1, (int)std::lround(NativeWidth * Scale));
+		int height = std::max(1, (int)std::lround(NativeHeight * Scale));
+		if (width != Width || height != Height)
+			allocate(width, height);
+		glBindFramebuffer(GL_FRAMEBUFFER, Framebuffer);
+		glViewport(0, 0, Width, Height);
+		return true;
+	}
+
+	// stretches the scene over the window with bilinear filtering and leaves the window framebuffer bound
+	void present()
+	{
+		glBindFramebuffer(GL_READ_FRAMEBUFFER, Framebuffer);
+		glBindFramebuffer(GL_DRAW_FRAMEBUFFER, 0);
+		glBlitFramebuffer(0, 0, Width, Height, 0, 0, NativeWidth, NativeHeight, GL_COLOR_BUFFER_BIT,
+			Width == NativeWidth && Height == NativeHeight ? GL_NEAREST : GL_LINEAR);
+		glBindFramebuffer(GL_FRAMEBUFFER, 0);
+		glViewport(0, 0, NativeWidth, NativeHeight);
+	}
+
+private:
+	GLuint Framebuffer = 0;
+	GLuint Color = 0;
+	GLuint Depth = 0;
+	int Width = 0;
+	int Height = 0;
+	int NativeWidth = 0;
+	int NativeHeight = 0;
+
+	void allocate(int width, int height)
+	{
+		destroy();
+		Width = width;
+		Height = height;
+
+		glActiveTexture(GL_TEXTURE0 + RENDER_TARGET_UNIT);
+		glGenTextures(1, &Color);
+		glBindTexture(GL_TEXTURE_2D, Color);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_RGBA8, width, height);
+		// 32 bit float like the depth copy of the Hi-Z pyramid
+		glGenTextures(1, &Depth);
+		glBindTexture(GL_TEXTURE_2D, Depth);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+		glTexStorage2D(GL_TEXTURE_2D, 1, GL_DEPTH_COMPONENT32F, width, height);
+		glActiveTexture(GL_TEXTURE0);
+
+		glGenFramebuffers(1, &Framebuffer);
+		glBindFramebuffer(GL_FRAMEBUFFER, Framebuffer);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0, GL_TEXTURE_2D, Color, 0);
+		glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, Depth, 0);
+		if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+			std::cout << "ERROR::RENDER_TARGET::FRAMEBUFFER_INCOMPLETE " << width << "x" << height << std::endl;
+	}
+};
+
+#endif
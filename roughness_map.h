@@ -0,0 +1,165 @@
+#ifndef ROUGHNESS_MAP_H
+#define ROUGHNESS_MAP_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include "heightmap.h"
+#include "simd.h"
+#include "thread_pool.h"
+
+// how far the terrain strays from a flat patch, per cell of a square grid over the heightmap
+// the error of a cell is the largest distance in meters between a height sample and the bilinear surface through the
+// cell's four corner samples, which is what a patch tessellated at level 1 would render.
+// level 0 has Cells x Cells entries, every next level halves the grid and bounds its error conservatively
+struct RoughnessMap
+{
+	int Cells = 0;
+	std::vector<std::vector<float>> Levels;
+};
+
+// largest |h[i] - (start + step * i)| over count samples
+inline float maxPlanarDeviation(const float* h, int count, float start, float step)
+{
+	int i = 0;
+	float worst = 0.0f;
+#if defined(HR_AVX2)
+	__m256 vworst = _mm256_setzero_ps();
+	__m256 vstep8 = _mm256_set1_ps(step * 8.0f);
+	__m256 vplane = _mm256_add_ps(_mm256_set1_ps(start), _mm256_mul_ps(_mm256_set1_ps(step), _mm256_setr_ps(0, 1, 2, 3, 4, 5, 6, 7)));
+	__m256 sign = _mm256_set1_ps(-0.0f);
+	for (; i + 8 <= count; i += 8)
+	{
+		__m256 d = _mm256_sub_ps(_mm256_loadu_ps(h + i), vplane);
+		vworst = _mm256_max_ps(vworst, _mm256_andnot_ps(sign, d));
+		vplane = _mm256_add_ps(vplane, vstep8);
+	}
+	worst = hmax(_mm_max_ps(_mm256_castps256_ps128(vworst), _mm256_extractf128_ps(vworst, 1)));
+#elif defined(HR_SSE2)
+	__m128 vworst = _mm_setzero_ps();
+	__m128 vstep4 = _mm_set1_ps(step * 4.0f);
+	__m128 vplane = _mm_add_ps(_mm_set1_ps(start), _mm_mul_ps(_mm_set1_ps(step), _mm_setr_ps(0, 1, 2, 3)));
+	for (; i + 4 <= count; i += 4)
+	{
+		vworst = _mm_max_ps(vworst, abs4(_mm_sub_ps(_mm_loadu_ps(h + i), vplane)));
+		vplane = _mm_add_ps(vplane, vstep4);
+	}
+	worst = hmax(vworst);
+#endif
+	for (; i < count; i++)
+		worst = std::max(worst, std::abs(h[i] - (start + step * i)));
+	return worst;
+}
+
+// sample range covered by cell c of n over size samples, neighbouring cells share their edge sample
+inline void roughnessCellRange(int c, int n, int size, int& first, int& last)
+{
+	first = (int)std::floor(c * (size - 1) / (double)n);
+	last = std::max(first + 1, (int)std::ceil((c + 1) * (size - 1) / (double)n));
+	last = std::min(last, size - 1);
+}
+
+inline RoughnessMap buildRoughnessMap(const Heightmap& map, int cells, ThreadPool& pool)
+{
+	RoughnessMap rough;
+	// at least two samples per cell so every cell has a surface to compare against
+	while (cells > 1 && (cells * 2 > map.Width || cells * 2 > map.Height))
+		cells /= 2;
+	rough.Cells = cells;
+	rough.Levels.emplace_back((size_t)cells * cells, 0.0f);
+	std::vector<float>& base = rough.Levels[0];
+
+	// one task per row of cells, each converts the sample rows it covers once and walks all cells along them
+	pool.parallelFor(cells, [&](size_t cy) {
+		int y0, y1;
+		roughnessCellRange((int)cy, cells, map.Height, y0, y1);
+		std::vector<float> row(map.Width);
+		std::vector<int> x0s(cells), x1s(cells);
+		std::vector<float> h00(cells), h10(cells), h01(cells), h11(cells);
+		for (int cx = 0; cx < cells; cx++)
+		{
+			roughnessCellRange(cx, cells, map.Width, x0s[cx], x1s[cx]);
+			h00[cx] = map.heightAt(x0s[cx], y0);
+			h10[cx] = map.heightAt(x1s[cx], y0);
+			h01[cx] = map.heightAt(x0s[cx], y1);
+			h11[cx] = map.heightAt(x1s[cx], y1);
+		}
+
+		float* errors = &base[cy * cells];
+		for (int y = y0; y <= y1; y++)
+		{
+			map.rowToMeters(y, 0, map.Width, row.data());
+			float v = (y - y0) / (float)(y1 - y0);
+			for (int cx = 0; cx < cells; cx++)
+			{
+				int x0 = x0s[cx], x1 = x1s[cx];
+				// along one row the bilinear surface is a line from the left to the right cell edge
+				float left = h00[cx] + (h01[cx] - h00[cx]) * v;
+				float right = h10[cx] + (h11[cx] - h10[cx]) * v;
+				float step = (right - left) / (float)(x1 - x0);
+				errors[cx] = std::max(errors[cx], maxPlanarDeviation(&row[x0], x1 - x0 + 1, left, step));
+			}
+		}
+	});
+
+	// coarser cells: |h - parent| <= |h - child| + |child - parent|, and the difference of the two bilinear surfaces
+	// peaks at the child corners, so the parent error is bounded by the worst child plus the deviation at those corners
+	for (int n = cells / 2; n >= 1; n /= 2)
+	{
+		const std::vector<float>& fine = rough.Levels.back();
+		std::vector<float> coarse((size_t)n * n);
+		for (int cy = 0; cy < n; cy++)
+		{
+			int y0, y1;
+			roughnessCellRange(cy, n, map.Height, y0, y1);
+			int ym = (y0 + y1) / 2;
+			float v = (ym - y0) / (float)std::max(1, y1 - y0);
+			for (int cx = 0; cx < n; cx++)
+			{
+				int x0, x1;
+				roughnessCellRange(cx, n, map.Width, x0, x1);
+				int xm = (x0 + x1) / 2;
+				float u = (xm - x0) / (float)std::max(1, x1 - x0);
+				float h00 = map.heightAt(x0, y0), h10 = map.heightAt(x1, y0);
+				float h01 = map.heightAt(x0, y1), h11 = map.heightAt(x1, y1);
+				auto surface = [&](float s, float t) {
+					return (h00 + (h10 - h00) * s) + ((h01 + (h11 - h01) * s) - (h00 + (h10 - h00) * s)) * t;
+				};
+				float corner = std::max({
+					std::abs(map.heightAt(xm, y0) - surface(u, 0.0f)),
+					std::abs(map.heightAt(xm, y1) - surface(u, 1.0f)),
+					std::abs(map.heightAt(x0, ym) - surface(0.0f, v)),
+					std::abs(map.heightAt(x1, ym) - surface(1.0f, v)),
+					std::abs(map.heightAt(xm, ym) - surface(u, v)) });
+				size_t f = (size_t)cy * 2 * (n * 2) + cx * 2;
+				float child = std::max({ fine[f], fine[f + 1], fine[f + n * 2], fine[f + n * 2 + 1] });
+				coarse[(size_t)cy * n + cx] = child + corner;
+			}
+		}
+		rough.Levels.push_back(std::move(coarse));
+	}
+	return rough;
+}
+
+// R32F texture with one mip level per roughness level, sampled with nearest filtering in the TCS
+inline GLuint createRoughnessTexture(const RoughnessMap& rough)
+{
+	GLuint texture;
+	glGenTextures(1, &texture);
+	glBindTexture(GL_TEXTURE_2D, texture);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST_MIPMAP_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexStorage2D(GL_TEXTURE_2D, (GLsizei)rough.Levels.size(), GL_R32F, rough.Cells, rough.Cells);
+	for (size_t l = 0; l < rough.Levels.size(); l++)
+	{
+		int n = std::max(1, rough.Cells >> l);
+		glTexSubImage2D(GL_TEXTURE_2D, (GLint)l, 0, 0, n, n, GL_RED, GL_FLOAT, rough.Levels[l].data());
+	}
+	return texture;
+}
+
+#endif
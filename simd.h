@@ -0,0 +1,40 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// instruction sets the CPU passes can use, picked at compile time
+// SSE2 is always there on x64, AVX2 needs /arch:AVX2 (MSVC) or -mavx2 (gcc/clang)
+// everything has a scalar fallback for other targets
+#if defined(__AVX2__)
+#define HR_AVX2 1
+#include <immintrin.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define HR_SSE2 1
+#include <emmintrin.h>
+#endif
+
+#ifdef HR_SSE2
+// horizontal max of 4 floats
+inline float hmax(__m128 v)
+{
+	v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+	v = _mm_max_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+	return _mm_cvtss_f32(v);
+}
+
+// horizontal min of 4 floats
+inline float hmin(__m128 v)
+{
+	v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(2, 3, 0, 1)));
+	v = _mm_min_ps(v, _mm_shuffle_ps(v, v, _MM_SHUFFLE(1, 0, 3, 2)));
+	return _mm_cvtss_f32(v);
+}
+
+inline __m128 abs4(__m128 v)
+{
+	return _mm_andnot_ps(_mm_set1_ps(-0.0f), v);
+}
+#endif
+
+#endif
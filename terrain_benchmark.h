@@ -0,0 +1,152 @@
+#ifndef TERRAIN_BENCHMARK_H
+#define TERRAIN_BENCHMARK_H
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include <glm/glm.hpp>
+#include "camera.h"
+#include "gpu_timer.h"
+
+// scripted flight for --benchmark: grazing views from around the map edge across the whole terrain, each drawn with
+// the explicit height lod off and on. low views over the full map are where the TES fetches the most texels far
+// apart, so the GPU time of the terrain pass shows how much texture cache traffic the lod saves
+class TerrainBenchmark
+{
+public:
+	static const int WARMUP_FRAMES = 30;
+	static const int MEASURED_FRAMES = 120;
+	static const int VIEWS = 8;
+
+	struct View
+	{
+		glm::vec3 Position;
+		float Yaw;
+		float Pitch;
+	};
+
+	// timings per view and setting, index view * 2 + explicit lod
+	struct Result
+	{
+		double TotalMs = 0.0;
+		double MaxMs = 0.0;
+		int Samples = 0;
+	};
+
+	bool Enabled = false;
+
+	// views just above the highest point, at the map edge in 8 directions and looking across the centre
+	void start(glm::vec2 terrainSize, float maxHeight)
+	{
+		Views.clear();
+		for (int i = 0; i < VIEWS; i++)
+		{
+			float angle = glm::radians(360.0f * i / VIEWS);
+			glm::vec2 dir(std::cos(angle), std::sin(angle));
+			glm::vec2 edge = -dir * terrainSize * 0.48f;
+			Views.push_back({ glm::vec3(edge.x, maxHeight + 10.0f, edge.y), glm::degrees(angle), -2.0f });
+		}
+		Results.assign(Views.size() * 2, Result());
+		Started = true;
+		Frame = 0;
+	}
+
+	bool started() const
+	{
+		return Started;
+	}
+
+	// some frames after the last view so the final queries come back
+	bool finished() const
+	{
+		return Started && Frame >= stepCount() * framesPerStep() + GpuTimer::FRAMES;
+	}
+
+	// sets up the frame the timer will measure next
+	void apply(Camera& camera, bool& explicitLod, const GpuTimer& timer)
+	{
+		int step = std::min(Frame / framesPerStep(), stepCount() - 1);
+		const View& view = Views[step / 2];
+		camera.Position = view.Position;
+		camera.Yaw = view.Yaw;
+		camera.Pitch = view.Pitch;
+		// recomputes the camera vectors
+		camera.ProcessMouseMovement(0.0f, 0.0f);
+		explicitLod = step % 2 == 1;
+		// past the last step the frames are only drawn to flush the queries
+		bool measured = Frame < stepCount() * framesPerStep() && Frame % framesPerStep() >= WARMUP_FRAMES;
+		TimerFrames.push_back({ timer.frames(), measured ? step : -1 });
+		Frame++;
+	}
+
+	// picks up the measurement the timer got this frame, if any
+	void record(const GpuTimer& timer)
+	{
+		for (const TimerFrame& frame : TimerFrames)
+		{
+			if (frame.Index != timer.Frame || frame.Step < 0)
+				continue;
+			Result& result = Results[frame.Step];
+			result.TotalMs += timer.Milliseconds;
+			result.MaxMs = std::max(result.MaxMs, timer.Milliseconds);
+			result.Samples++;
+		}
+	}
+
+	void report(const std::string& csvPath) const
+	{
+		std::ofstream csv(csvPath);
+		csv << "view,x,z,yaw,lod,avg_ms,max_ms,samples\n";
+		double total[2] = { 0.0, 0.0 };
+		std::cout << "Benchmark, terrain pass GPU time (ms), texture() vs textureLod:" << std::endl;
+		for (size_t v = 0; v < Views.size(); v++)
+		{
+			double average[2];
+			for (int lod = 0; lod < 2; lod++)
+			{
+				const Result& result = Results[v * 2 + lod];
+				average[lod] = result.Samples ? result.TotalMs / result.Samples : 0.0;
+				total[lod] += average[lod];
+				csv << v << "," << Views[v].Position.x << "," << Views[v].Position.z << "," << Views[v].Yaw << ","
+					<< (lod ? "explicit" : "base") << "," << average[lod] << "," << result.MaxMs << "," << result.Samples << "\n";
+			}
+			std::cout << std::fixed << std::setprecision(3) << "  view " << v << " (yaw " << std::setprecision(0) << Views[v].Yaw
+				<< "): " << std::setprecision(3) << average[0] << " -> " << average[1] << std::endl;
+		}
+		if (total[1] > 0.0)
+			std::cout << "  average: " << total[0] / Views.size() << " -> " << total[1] / Views.size() << " ("
+				<< std::setprecision(2) << total[0] / total[1] << "x)" << std::endl;
+		std::cout << std::defaultfloat << "Results written to " << csvPath << std::endl;
+	}
+
+private:
+	// the step a timer frame belongs to, -1 for warm up frames
+	struct TimerFrame
+	{
+		unsigned Index;
+		int Step;
+	};
+
+	std::vector<View> Views;
+	std::vector<Result> Results;
+	std::vector<TimerFrame> TimerFrames;
+	bool Started = false;
+	int Frame = 0;
+
+	int stepCount() const
+	{
+		return (int)Views.size() * 2;
+	}
+
+	static int framesPerStep()
+	{
+		return WARMUP_FRAMES + MEASURED_FRAMES;
+	}
+};
+
+#endif
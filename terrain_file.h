@@ -0,0 +1,294 @@
+#ifndef TERRAIN_FILE_H
+#define TERRAIN_FILE_H
+
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include "heightmap.h"
+#include "mapped_file.h"
+
+// .hrt terrain container, a tiled mip pyramid that can be uploaded without any decoding
+//
+// layout: [TerrainFileHeader][TerrainLevel x LevelCount][TerrainTile x TileCount][tile payloads]
+// level 0 is full resolution, every next level halves the size down to 1x1.
+// each tile payload holds (TileSize + 2 * Border)^2 samples row major in the header's format,
+// the border repeats the texels of the neighbouring tiles (clamped at the map edge) so a tile filters seamlessly on its own.
+// payloads start at multiples of TERRAIN_TILE_ALIGNMENT so they line up with pages of the mapping.
+
+const char TERRAIN_MAGIC[4] = { 'H', 'R', 'T', '1' };
+const uint32_t TERRAIN_VERSION = 1;
+const uint32_t TERRAIN_TILE_ALIGNMENT = 4096;
+// largest tile side open() accepts, the border can be at most as wide as the tile
+const uint32_t TERRAIN_MAX_TILE_SIZE = 16384;
+
+struct TerrainFileHeader
+{
+	char Magic[4];
+	uint32_t Version;
+	uint32_t Width;       // level 0 size in samples
+	uint32_t Height;
+	uint32_t TileSize;    // tile size without the border
+	uint32_t Border;      // extra samples on every side of a tile
+	uint32_t LevelCount;
+	uint32_t TileCount;   // tiles over all levels
+	uint32_t Format;      // HeightFormat
+	float Scale;          // meters = sample * Scale + Offset
+	float Offset;
+	float MinHeight;      // meters
+	float MaxHeight;
+	uint32_t Reserved[3];
+};
+
+struct TerrainLevel
+{
+	uint32_t Width;
+	uint32_t Height;
+	uint32_t TilesX;
+	uint32_t TilesY;
+	uint32_t FirstTile;   // index of the level's first tile in the tile table, tiles are stored row major
+	uint32_t Reserved;
+};
+
+struct TerrainTile
+{
+	uint64_t DataOffset;  // from the start of the file
+	float MinHeight;      // meters, without the border
+	float MaxHeight;
+};
+
+static_assert(sizeof(TerrainFileHeader) == 64, "TerrainFileHeader layout changed");
+static_assert(sizeof(TerrainLevel) == 24, "TerrainLevel layout changed");
+static_assert(sizeof(TerrainTile) == 16, "TerrainTile layout changed");
+
+inline uint64_t alignTerrainOffset(uint64_t offset)
+{
+	return (offset + TERRAIN_TILE_ALIGNMENT - 1) / TERRAIN_TILE_ALIGNMENT * TERRAIN_TILE_ALIGNMENT;
+}
+
+// memory mapped .hrt file
+class TerrainFile
+{
+public:
+	bool open(const char* path)
+	{
+		if (!File.open(path))
+			return false;
+
+		const unsigned char* base = File.data();
+		if (File.size() < sizeof(TerrainFileHeader))
+			return fail(path, "file too small");
+		Header = (const TerrainFileHeader*)base;
+		if (memcmp(Header->Magic, TERRAIN_MAGIC, 4) != 0 || Header->Version != TERRAIN_VERSION)
+			return fail(path, "not a version 1 .hrt file");
+		if (Header->Format != HEIGHT_R16 && Header->Format != HEIGHT_R32F)
+			return fail(path, "unknown sample format");
+		if (Header->TileSize == 0 || Header->LevelCount == 0 || Header->LevelCount > 32)
+			return fail(path, "bad tiling");
+		// keeps tileBytes() far from overflowing
+		if (Header->TileSize > TERRAIN_MAX_TILE_SIZE || Header->Border >= Header->TileSize)
+			return fail(path, "tile size or border out of range");
+
+		size_t tablesEnd = sizeof(TerrainFileHeader) + Header->LevelCount * sizeof(TerrainLevel) + (size_t)Header->TileCount * sizeof(TerrainTile);
+		if (File.size() < tablesEnd)
+			return fail(path, "truncated tables");
+		Levels = (const TerrainLevel*)(base + sizeof(TerrainFileHeader));
+		Tiles = (const TerrainTile*)(Levels + Header->LevelCount);
+
+		for (uint32_t l = 0; l < Header->LevelCount; l++)
+		{
+			const TerrainLevel& level = Levels[l];
+			if ((uint64_t)level.FirstTile + (uint64_t)level.TilesX * level.TilesY > Header->TileCount)
+				return fail(path, "level references missing tiles");
+			if (level.Width == 0 || level.Height == 0 || level.TilesX == 0 || level.TilesY == 0)
+				return fail(path, "empty level");
+			if ((uint64_t)level.TilesX * Header->TileSize < level.Width || (uint64_t)level.TilesY * Header->TileSize < level.Height)
+				return fail(path, "level not covered by its tiles");
+			if ((uint64_t)(level.TilesX - 1) * Header->TileSize >= level.Width || (uint64_t)(level.TilesY - 1) * Header->TileSize >= level.Height)
+				return fail(path, "level has tiles outside the map");
+			// the texture size and the streamer's parent/child tile walk depend on these
+			if (l == 0 && (level.Width != Header->Width || level.Height != Header->Height))
+				return fail(path, "level 0 doesn't match the header size");
+			if (l > 0 && (level.Width != std::max(1u, Levels[l - 1].Width / 2) || level.Height != std::max(1u, Levels[l - 1].Height / 2)))
+				return fail(path, "level doesn't halve the one before");
+		}
+		if (tileBytes() > File.size())
+			return fail(path, "tile payload out of range");
+		for (uint32_t t = 0; t < Header->TileCount; t++)
+		{
+			// subtracted on the file side so a huge offset can't wrap around
+			if (Tiles[t].DataOffset < tablesEnd || Tiles[t].DataOffset > File.size() - tileBytes())
+				return fail(path, "tile payload out of range");
+		}
+		return true;
+	}
+
+	void close()
+	{
+		File.close();
+		Header = nullptr;
+		Levels = nullptr;
+		Tiles = nullptr;
+	}
+
+	bool isOpen() const
+	{
+		return Header != nullptr;
+	}
+
+	const TerrainFileHeader& header() const
+	{
+		return *Header;
+	}
+
+	HeightFormat format() const
+	{
+		return (HeightFormat)Header->Format;
+	}
+
+	int levelCount() const
+	{
+		return (int)Header->LevelCount;
+	}
+
+	const TerrainLevel& level(int l) const
+	{
+		return Levels[l];
+	}
+
+	const TerrainTile& tile(int l, int x, int y) const
+	{
+		const TerrainLevel& lv = Levels[l];
+		return Tiles[lv.FirstTile + (size_t)y * lv.TilesX + x];
+	}
+
+	// by index into the tile table, over all levels
+	const TerrainTile& tile(uint32_t index) const
+	{
+		return Tiles[index];
+	}
+
+	// samples per stored tile row, including both borders
+	size_t tileStride() const
+	{
+		return Header->TileSize + 2 * (size_t)Header->Border;
+	}
+
+	size_t bytesPerSample() const
+	{
+		return Header->Format == HEIGHT_R16 ? sizeof(uint16_t) : sizeof(float);
+	}
+
+	size_t tileBytes() const
+	{
+		return tileStride() * tileStride() * bytesPerSample();
+	}
+
+	// first sample of the tile's border, points into the mapping
+	const void* tileData(const TerrainTile& t) const
+	{
+		return File.data() + t.DataOffset;
+	}
+
+	// copies one level out of its tiles into a heightmap, only row copies from the mapping, no decoding
+	bool readLevel(int l, Heightmap& map) const
+	{
+		if (l < 0 || l >= levelCount())
+			return false;
+		const TerrainLevel& lv = level(l);
+		map.Width = lv.Width;
+		map.Height = lv.Height;
+		map.Format = format();
+		map.Scale = Header->Scale;
+		map.Offset = Header->Offset;
+		map.MinHeight = Header->MinHeight;
+		map.MaxHeight = Header->MaxHeight;
+		map.Data16.clear();
+		map.Data32.clear();
+		if (map.Format == HEIGHT_R16)
+			map.Data16.resize((size_t)lv.Width * lv.Height);
+		else
+			map.Data32.resize((size_t)lv.Width * lv.Height);
+
+		unsigned char* dst = (unsigned char*)map.data();
+		size_t bps = bytesPerSample();
+		for (uint32_t ty = 0; ty < lv.TilesY; ty++)
+		{
+			for (uint32_t tx = 0; tx < lv.TilesX; tx++)
+			{
+				uint32_t x = tx * Header->TileSize;
+				uint32_t y = ty * Header->TileSize;
+				uint32_t w = std::min(Header->TileSize, lv.Width - x);
+				uint32_t h = std::min(Header->TileSize, lv.Height - y);
+				const unsigned char* src = (const unsigned char*)tileData(tile(l, tx, ty));
+				for (uint32_t row = 0; row < h; row++)
+				{
+					const unsigned char* from = src + ((row + Header->Border) * tileStride() + Header->Border) * bps;
+					memcpy(dst + ((size_t)(y + row) * lv.Width + x) * bps, from, w * bps);
+				}
+			}
+		}
+		return true;
+	}
+
+	// creates an immutable texture with every level of the pyramid, the samples are handed to GL straight from the mapping
+	// the texture is left bound to GL_TEXTURE_2D on the active texture unit
+	GLuint createTexture() const
+	{
+		GLuint texture;
+		glGenTextures(1, &texture);
+		glBindTexture(GL_TEXTURE_2D, texture);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, levelCount() - 1);
+
+		bool is16 = format() == HEIGHT_R16;
+		glTexStorage2D(GL_TEXTURE_2D, levelCount(), is16 ? GL_R16 : GL_R32F, Header->Width, Header->Height);
+
+		// skip the border while reading the interior of every tile
+		glPixelStorei(GL_UNPACK_ALIGNMENT, is16 ? 2 : 4);
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, (GLint)tileStride());
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS, (GLint)Header->Border);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS, (GLint)Header->Border);
+		for (int l = 0; l < levelCount(); l++)
+		{
+			const TerrainLevel& lv = level(l);
+			for (uint32_t ty = 0; ty < lv.TilesY; ty++)
+			{
+				for (uint32_t tx = 0; tx < lv.TilesX; tx++)
+				{
+					uint32_t x = tx * Header->TileSize;
+					uint32_t y = ty * Header->TileSize;
+					GLsizei w = (GLsizei)std::min(Header->TileSize, lv.Width - x);
+					GLsizei h = (GLsizei)std::min(Header->TileSize, lv.Height - y);
+					glTexSubImage2D(GL_TEXTURE_2D, l, x, y, w, h, GL_RED, is16 ? GL_UNSIGNED_SHORT : GL_FLOAT, tileData(tile(l, tx, ty)));
+				}
+			}
+		}
+		glPixelStorei(GL_UNPACK_ROW_LENGTH, 0);
+		glPixelStorei(GL_UNPACK_SKIP_PIXELS, 0);
+		glPixelStorei(GL_UNPACK_SKIP_ROWS, 0);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+
+		return texture;
+	}
+
+private:
+	MappedFile File;
+	const TerrainFileHeader* Header = nullptr;
+	const TerrainLevel* Levels = nullptr;
+	const TerrainTile* Tiles = nullptr;
+
+	bool fail(const char* path, const char* reason)
+	{
+		std::cout << "ERROR::TERRAIN_FILE::INVALID " << path << ": " << reason << std::endl;
+		close();
+		return false;
+	}
+};
+
+#endif
@@ -0,0 +1,168 @@
+#ifndef TERRAIN_QUADTREE_H
+#define TERRAIN_QUADTREE_H
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+#include <algorithm>
+
+#include <glm/glm.hpp>
+#include "frustum.h"
+#include "height_pyramid.h"
+
+// every selected node is drawn as the same mesh of QUADTREE_NODE_PATCHES^2 patches, each tessellated to a fixed
+// QUADTREE_TESS_LEVEL, so a node is a regular grid of QUADTREE_GRID_REZ quads per side stretched over its area.
+// the level is odd so fractional_odd_spacing gives equal segments, and the grid rez is even so every other vertex
+// of a node lines up with the grid of its parent, which the TES morphs towards (CDLOD)
+const int QUADTREE_NODE_PATCHES = 8;
+const int QUADTREE_TESS_LEVEL = 7;
+const int QUADTREE_GRID_REZ = QUADTREE_NODE_PATCHES * QUADTREE_TESS_LEVEL;
+// leaves cover at most this many samples per side
+const int QUADTREE_LEAF_SAMPLES = 64;
+const int QUADTREE_MAX_LODS = 16;
+// a lod morphs into the next one over the last part of its range
+const float QUADTREE_MORPH_START = 0.7f;
+
+// per instance attributes of the node mesh, rect in model space xz
+struct QuadtreeInstance
+{
+	float X, Z, SizeX, SizeZ;
+	float Lod;
+};
+
+// quadtree over the heightmap, lod 0 are the leaves and every next lod halves the node count per side.
+// nodes are implicit, node (x, y) of a lod has children (2x + dx, 2y + dy) one lod down and gets its height bounds
+// from the min/max pyramid
+class TerrainQuadtree
+{
+public:
+	int Selected = 0;
+	int Culled = 0;
+
+	bool empty() const
+	{
+		return Lods == 0;
+	}
+
+	int lodCount() const
+	{
+		return Lods;
+	}
+
+	// (morph start, morph end) per lod for the TES
+	const std::vector<glm::vec2>& morphRanges() const
+	{
+		return MorphRanges;
+	}
+
+	const std::vector<QuadtreeInstance>& selection() const
+	{
+		return Selection;
+	}
+
+	// the pyramid has to outlive the quadtree
+	void build(const HeightPyramid& pyramid, int width, int height)
+	{
+		Pyramid = &pyramid;
+		Width = (float)width;
+		Height = (float)height;
+		LeafCells = 1;
+		Lods = 1;
+		while (Lods < QUADTREE_MAX_LODS && LeafCells * QUADTREE_LEAF_SAMPLES < std::max(width, height))
+		{
+			LeafCells *= 2;
+			Lods++;
+		}
+		MorphRanges.assign(Lods, glm::vec2(0.0f));
+		LastCamera = glm::vec3(NAN);
+	}
+
+	// pixelsPerUnit is the projected size of one unit at distance 1, projection[1][1] * 0.5 * viewport height.
+	// returns true when the selection differs from the previous call, so the caller can skip the upload.
+	// updates are not incremental: nothing is recomputed while the camera, frustum and settings stay exactly the same,
+	// but any change re-walks the whole tree from the root and rebuilds the instance list. the walk stops at nodes
+	// outside the frustum and at nodes drawn at their own lod
+	bool select(const glm::vec3& camera, const Frustum& frustum, float pixelsPerUnit, float triangleSize)
+	{
+		if (Lods == 0)
+			return false;
+		if (camera == LastCamera && pixelsPerUnit == LastPixelsPerUnit && triangleSize == LastTriangleSize
+			&& memcmp(&frustum, &LastFrustum, sizeof(Frustum)) == 0)
+			return false;
+		LastCamera = camera;
+		LastFrustum = frustum;
+		LastPixelsPerUnit = pixelsPerUnit;
+		LastTriangleSize = triangleSize;
+
+		// a lod is used up to the distance where its grid spacing shrinks to triangleSize pixels, but at least two
+		// leaf diagonals out so neighbouring nodes never differ by more than one lod. ranges double every lod
+		float leafX = Width / LeafCells, leafZ = Height / LeafCells;
+		float spacing = std::max(leafX, leafZ) / QUADTREE_GRID_REZ;
+		float range = std::max(spacing * pixelsPerUnit / std::max(triangleSize, 0.01f), 2.0f * std::sqrt(leafX * leafX + leafZ * leafZ));
+		Ranges.resize(Lods);
+		for (int l = 0; l < Lods; l++)
+		{
+			Ranges[l] = range * (float)(1 << l);
+			float previous = l > 0 ? Ranges[l - 1] : 0.0f;
+			MorphRanges[l] = glm::vec2(previous + (Ranges[l] - previous) * QUADTREE_MORPH_START, Ranges[l]);
+		}
+
+		Previous.swap(Selection);
+		Selection.clear();
+		Selected = Culled = 0;
+		selectNode(camera, frustum, lodCount() - 1, 0, 0);
+		Selected = (int)Selection.size();
+		return Selection.size() != Previous.size()
+			|| memcmp(Selection.data(), Previous.data(), Selection.size() * sizeof(QuadtreeInstance)) != 0;
+	}
+
+private:
+	const HeightPyramid* Pyramid = nullptr;
+	float Width = 0.0f;
+	float Height = 0.0f;
+	int LeafCells = 0;
+	int Lods = 0;
+	std::vector<float> Ranges;
+	std::vector<glm::vec2> MorphRanges;
+	std::vector<QuadtreeInstance> Selection;
+	std::vector<QuadtreeInstance> Previous;
+
+	glm::vec3 LastCamera = glm::vec3(NAN);
+	Frustum LastFrustum = {};
+	float LastPixelsPerUnit = 0.0f;
+	float LastTriangleSize = 0.0f;
+
+	static float boxDistance2(const glm::vec3& p, const glm::vec3& boxMin, const glm::vec3& boxMax)
+	{
+		glm::vec3 d = glm::max(glm::max(boxMin - p, p - boxMax), glm::vec3(0.0f));
+		return glm::dot(d, d);
+	}
+
+	// a node is drawn once the camera is out of the range of the lod below it, otherwise its children are tried.
+	// children outside their own range still get drawn at their lod, the TES then morphs them fully to this one
+	void selectNode(const glm::vec3& camera, const Frustum& frustum, int lod, int x, int y)
+	{
+		int cells = LeafCells >> lod;
+		float lo, hi;
+		Pyramid->bounds(x / (float)cells, y / (float)cells, (x + 1) / (float)cells, (y + 1) / (float)cells, lo, hi);
+		float sizeX = Width / cells, sizeZ = Height / cells;
+		glm::vec3 boxMin(-Width * 0.5f + x * sizeX, lo, -Height * 0.5f + y * sizeZ);
+		glm::vec3 boxMax(boxMin.x + sizeX, hi, boxMin.z + sizeZ);
+		if (!frustum.intersectsBox(boxMin, boxMax))
+		{
+			Culled++;
+			return;
+		}
+
+		if (lod == 0 || boxDistance2(camera, boxMin, boxMax) > Ranges[lod - 1] * Ranges[lod - 1])
+		{
+			Selection.push_back({ boxMin.x, boxMin.z, sizeX, sizeZ, (float)lod });
+			return;
+		}
+
+		for (int c = 0; c < 4; c++)
+			selectNode(camera, frustum, lod - 1, x * 2 + (c & 1), y * 2 + (c >> 1));
+	}
+};
+
+#endif
@@ -0,0 +1,79 @@
+#ifndef TESS_BUDGET_H
+#define TESS_BUDGET_H
+
+#include <cmath>
+#include <algorithm>
+
+#include "gpu_timer.h"
+
+// steers a value towards a GPU time budget, for costs that grow with its square (tessellation levels, the render
+// scale per axis), so the correction is the square root of the time ratio.
+// against oscillation: nothing changes while the time is inside a dead band around the target, a step is limited in
+// size (down faster than up), and after a step the measurements still taken with the old value are ignored
+class BudgetController
+{
+public:
+	float TargetMilliseconds = 8.0f;
+	// dead band as fractions of the target
+	float LowBand = 0.85f;
+	float HighBand = 1.05f;
+	float MinValue;
+	float MaxValue;
+	// largest factors of a single step down and up
+	float MaxDecrease;
+	float MaxIncrease;
+	// steps land on multiples of this, 0 for none
+	float Quantum;
+
+	BudgetController(float minValue, float maxValue, float maxDecrease, float maxIncrease, float quantum = 0.0f)
+		: MinValue(minValue), MaxValue(maxValue), MaxDecrease(maxDecrease), MaxIncrease(maxIncrease), Quantum(quantum)
+	{
+	}
+
+	// call whenever the timer has a new measurement, returns true when value changed
+	bool update(const GpuTimer& timer, float& value)
+	{
+		// still drawn with the value before the last step
+		if (timer.Frame < SettledFrame)
+			return false;
+		double ratio = timer.Milliseconds / TargetMilliseconds;
+		if (ratio >= LowBand && ratio <= HighBand)
+			return false;
+		float step = (float)std::sqrt(1.0 / std::max(ratio, 1e-3));
+		float next = value * std::clamp(step, MaxDecrease, MaxIncrease);
+		if (Quantum > 0.0f)
+			next = std::round(next / Quantum) * Quantum;
+		next = std::clamp(next, MinValue, MaxValue);
+		if (next == value)
+			return false;
+		value = next;
+		SettledFrame = timer.frames();
+		return true;
+	}
+
+private:
+	unsigned SettledFrame = 0;
+};
+
+// holds the terrain draw near a GPU time budget by scaling every tessellation level with one multiplier
+class TessBudget
+{
+public:
+	bool Enabled = false;
+	BudgetController Controller{ 0.125f, 2.0f, 0.7f, 1.1f };
+	// current scale of the tessellation levels
+	float Multiplier = 1.0f;
+
+	// call whenever the timer has a new measurement
+	void update(const GpuTimer& timer)
+	{
+		if (!Enabled)
+		{
+			Multiplier = 1.0f;
+			return;
+		}
+		Controller.update(timer, Multiplier);
+	}
+};
+
+#endif
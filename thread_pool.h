@@ -0,0 +1,139 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <algorithm>
+
+// fixed set of worker threads pulling tasks from one FIFO queue
+class ThreadPool
+{
+public:
+	// 0 threads means one per hardware thread
+	explicit ThreadPool(unsigned threads = 0)
+	{
+		if (threads == 0)
+			threads = std::max(1u, std::thread::hardware_concurrency());
+		for (unsigned i = 0; i < threads; i++)
+			Workers.emplace_back([this] { workerLoop(); });
+	}
+
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Stopping = true;
+		}
+		TaskReady.notify_all();
+		for (std::thread& worker : Workers)
+			worker.join();
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	unsigned size() const
+	{
+		return (unsigned)Workers.size();
+	}
+
+	void submit(std::function<void()> task)
+	{
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Tasks.push_back(std::move(task));
+		}
+		TaskReady.notify_one();
+	}
+
+	// blocks until the queue is empty and no task is running
+	void wait()
+	{
+		std::unique_lock<std::mutex> lock(Mutex);
+		Idle.wait(lock, [this] { return Tasks.empty() && Running == 0; });
+	}
+
+	// runs fn(i) for every i in [0, count) on the pool and the calling thread, returns when all are done
+	// indices are handed out one at a time so uneven work (tiles at the map edge, empty rows) balances itself
+	void parallelFor(size_t count, const std::function<void(size_t)>& fn)
+	{
+		if (count == 0)
+			return;
+
+		// shared with the helper tasks, which may only get to run after this call returned if the pool is busy
+		struct Loop
+		{
+			std::atomic<size_t> Next{ 0 };
+			std::atomic<size_t> Done{ 0 };
+			size_t Count = 0;
+			const std::function<void(size_t)>* Fn = nullptr;
+			std::mutex Mutex;
+			std::condition_variable Finished;
+		};
+		auto loop = std::make_shared<Loop>();
+		loop->Count = count;
+		loop->Fn = &fn;
+
+		auto run = [](Loop& l) {
+			size_t i;
+			while ((i = l.Next.fetch_add(1)) < l.Count)
+			{
+				(*l.Fn)(i);
+				if (l.Done.fetch_add(1) + 1 == l.Count)
+				{
+					std::lock_guard<std::mutex> lock(l.Mutex);
+					l.Finished.notify_all();
+				}
+			}
+		};
+
+		size_t helpers = std::min<size_t>(count - 1, Workers.size());
+		for (size_t h = 0; h < helpers; h++)
+			submit([loop, run] { run(*loop); });
+		run(*loop);
+
+		std::unique_lock<std::mutex> lock(loop->Mutex);
+		loop->Finished.wait(lock, [&] { return loop->Done.load() == loop->Count; });
+	}
+
+private:
+	std::vector<std::thread> Workers;
+	std::deque<std::function<void()>> Tasks;
+	std::mutex Mutex;
+	std::condition_variable TaskReady;
+	std::condition_variable Idle;
+	unsigned Running = 0;
+	bool Stopping = false;
+
+	void workerLoop()
+	{
+		for (;;)
+		{
+			std::function<void()> task;
+			{
+				std::unique_lock<std::mutex> lock(Mutex);
+				TaskReady.wait(lock, [this] { return Stopping || !Tasks.empty(); });
+				if (Stopping && Tasks.empty())
+					return;
+				task = std::move(Tasks.front());
+				Tasks.pop_front();
+				Running++;
+			}
+			task();
+			{
+				std::lock_guard<std::mutex> lock(Mutex);
+				Running--;
+				if (Tasks.empty() && Running == 0)
+					Idle.notify_all();
+			}
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,568 @@
+#ifndef TILE_STREAMER_H
+#define TILE_STREAMER_H
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <deque>
+#include <iostream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include <algorithm>
+
+#include <glad/glad.h>
+#include <glm/glm.hpp>
+#include "frustum.h"
+#include "terrain_file.h"
+#include "thread_pool.h"
+
+// streamed levels the shaders know about, a 256 sample tile at level 15 already covers 8M samples
+const int TILE_STREAM_MAX_LEVELS = 16;
+// page table entry: resident page in the low 16 bits, for level 0 tiles the finest wanted level in bits 16..23
+const uint32_t TILE_NO_PAGE = 0xFFFF;
+const uint32_t TILE_NO_LEVEL = 0xFF;
+
+typedef std::shared_ptr<const std::vector<unsigned char>> TileData;
+
+// a camera the streamer selects tiles for, in model space
+struct TileView
+{
+	glm::vec3 Camera;
+	Frustum View;
+};
+
+// tiles copied out of the file, least recently used goes first once Capacity is reached.
+// filled by the workers and read by the GL thread
+class TileCache
+{
+public:
+	size_t Capacity = 1024;
+
+	TileData find(uint32_t tile)
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		auto it = Entries.find(tile);
+		if (it == Entries.end())
+			return nullptr;
+		Order.splice(Order.begin(), Order, it->second.second);
+		return it->second.first;
+	}
+
+	void insert(uint32_t tile, TileData data)
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		auto it = Entries.find(tile);
+		if (it != Entries.end())
+		{
+			Order.splice(Order.begin(), Order, it->second.second);
+			it->second.first = std::move(data);
+			return;
+		}
+		Order.push_front(tile);
+		Entries.emplace(tile, std::make_pair(std::move(data), Order.begin()));
+		while (Entries.size() > Capacity)
+		{
+			Entries.erase(Order.back());
+			Order.pop_back();
+		}
+	}
+
+	size_t size()
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		return Entries.size();
+	}
+
+private:
+	std::mutex Mutex;
+	std::list<uint32_t> Order;
+	std::unordered_map<uint32_t, std::pair<TileData, std::list<uint32_t>::iterator>> Entries;
+};
+
+// out of core heights for .hrt terrains too big for one texture. the levels finer than the overview texture are
+// paged in tile by tile: every frame the tiles whose parent would be too coarse on screen are wanted, ordered by
+// their screen space error. workers copy them out of the mapping into a RAM cache and the GL thread moves them into
+// a fixed texture array of pages under a per frame time budget, evicting the pages that have gone unused longest.
+// a texture buffer page table tells the TES where each tile lives, so memory stays the same for any terrain size
+// apart from the per tile bookkeeping: 14 bytes in RAM (page, wanted and prefetch frames, the table copy), 1 more for
+// the finest tiles, and 4 bytes of page table on the GPU
+class TileStreamer
+{
+public:
+	// pages in the texture array, clamped to GL_MAX_ARRAY_TEXTURE_LAYERS
+	int PoolPages = 256;
+	double UploadBudgetMs = 2.0;
+	// a tile is wanted while its parent's samples are bigger than this many pixels
+	float TargetError = 1.0f;
+
+	int Wanted = 0;
+	int Prefetched = 0;
+	int Resident = 0;
+	int Queued = 0;
+	int Uploaded = 0;
+	// queued requests dropped because no view wanted them anymore, since init
+	int Cancelled = 0;
+
+	~TileStreamer()
+	{
+		if (!Pool)
+			return;
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Stopping = true;
+		}
+		// queued loads return right away, loads already running finish first
+		Pool->wait();
+	}
+
+	bool enabled() const
+	{
+		return Pool != nullptr;
+	}
+
+	// streams levels 0..streamedLevels-1 of the file, everything coarser is expected in the overview texture
+	bool init(const char* path, int streamedLevels, size_t cacheTiles, ThreadPool& pool)
+	{
+		if (!File.open(path))
+			return false;
+		const TerrainFileHeader& header = File.header();
+		StreamedLevels = std::clamp(streamedLevels, 0, std::min(File.levelCount() - 1, TILE_STREAM_MAX_LEVELS));
+		if (StreamedLevels == 0)
+		{
+			File.close();
+			return false;
+		}
+		Pool = &pool;
+		Cache.Capacity = cacheTiles;
+		TileLevels.clear();
+		LevelSizes.clear();
+		for (int l = 0; l < StreamedLevels; l++)
+		{
+			const TerrainLevel& lv = File.level(l);
+			TileLevels.push_back(glm::vec4((float)lv.TilesX, (float)lv.TilesY, (float)lv.FirstTile, 0.0f));
+			LevelSizes.push_back(glm::vec2((float)lv.Width, (float)lv.Height));
+		}
+		PageOf.assign(header.TileCount, TILE_NO_PAGE);
+		WantedFrame.assign(header.TileCount, 0);
+		PrefetchFrame.assign(header.TileCount, 0);
+		WantedLevels.assign((size_t)File.level(0).TilesX * File.level(0).TilesY, TILE_NO_LEVEL);
+		Table.assign(header.TileCount, TILE_NO_PAGE | (TILE_NO_LEVEL << 16));
+		DirtyFirst = UINT32_MAX;
+		DirtyLast = 0;
+
+		GLint maxLayers = 256;
+		glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+		PoolPages = std::clamp(PoolPages, 1, std::min<int>(maxLayers, TILE_NO_PAGE));
+		PageTile.assign(PoolPages, UINT32_MAX);
+		PageUsed.assign(PoolPages, 0);
+		Resident = 0;
+
+		GLsizei stride = (GLsizei)File.tileStride();
+		glGenTextures(1, &PageTexture);
+		glBindTexture(GL_TEXTURE_2D_ARRAY, PageTexture);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+		glTexStorage3D(GL_TEXTURE_2D_ARRAY, 1, File.format() == HEIGHT_R16 ? GL_R16 : GL_R32F, stride, stride, PoolPages);
+
+		glGenBuffers(1, &TableBuffer);
+		glBindBuffer(GL_TEXTURE_BUFFER, TableBuffer);
+		glBufferData(GL_TEXTURE_BUFFER, Table.size() * sizeof(uint32_t), Table.data(), GL_DYNAMIC_DRAW);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		glGenTextures(1, &TableTexture);
+		glBindTexture(GL_TEXTURE_BUFFER, TableTexture);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_R32UI, TableBuffer);
+
+		std::cout << "Streaming " << StreamedLevels << " levels of " << path << " through " << PoolPages << " pages of "
+			<< stride << "x" << stride << ", " << cacheTiles << " tiles cached in RAM" << std::endl;
+		return true;
+	}
+
+	void destroy()
+	{
+		glDeleteTextures(1, &PageTexture);
+		glDeleteTextures(1, &TableTexture);
+		glDeleteBuffers(1, &TableBuffer);
+	}
+
+	GLuint pageTexture() const
+	{
+		return PageTexture;
+	}
+
+	GLuint pageTableTexture() const
+	{
+		return TableTexture;
+	}
+
+	int streamedLevels() const
+	{
+		return StreamedLevels;
+	}
+
+	float tileSize() const
+	{
+		return (float)File.header().TileSize;
+	}
+
+	float tileBorder() const
+	{
+		return (float)File.header().Border;
+	}
+
+	// (tiles x, tiles y, first tile, 0) per streamed level
+	const std::vector<glm::vec4>& tileLevels() const
+	{
+		return TileLevels;
+	}
+
+	// samples per streamed level
+	const std::vector<glm::vec2>& levelSizes() const
+	{
+		return LevelSizes;
+	}
+
+	size_t cachedTiles()
+	{
+		return Cache.size();
+	}
+
+	// pick the wanted tiles, queue the missing ones and upload what the workers finished, pixelsPerUnit as in
+	// TerrainQuadtree::select. predicted views (where the camera is about to be) only prefetch: their tiles load
+	// after everything visible, never replace a page the current view uses and are dropped from the queue as soon as
+	// no view wants them anymore
+	void update(const TileView& view, const std::vector<TileView>& predicted, float pixelsPerUnit)
+	{
+		if (!Pool)
+			return;
+		Frame++;
+		Wanted = Prefetched = Uploaded = 0;
+		std::vector<uint8_t> previousLevels = WantedLevels;
+		std::fill(WantedLevels.begin(), WantedLevels.end(), (uint8_t)TILE_NO_LEVEL);
+
+		int top = StreamedLevels - 1;
+		const TerrainLevel& topLevel = File.level(top);
+		for (uint32_t y = 0; y < topLevel.TilesY; y++)
+			for (uint32_t x = 0; x < topLevel.TilesX; x++)
+				visit(view, pixelsPerUnit, false, top, x, y);
+		for (const TileView& ahead : predicted)
+			for (uint32_t y = 0; y < topLevel.TilesY; y++)
+				for (uint32_t x = 0; x < topLevel.TilesX; x++)
+					visit(ahead, pixelsPerUnit, true, top, x, y);
+
+		cancelStale();
+		uint32_t first = File.level(0).FirstTile;
+		for (size_t t = 0; t < WantedLevels.size(); t++)
+			if (WantedLevels[t] != previousLevels[t])
+				markDirty(first + (uint32_t)t);
+		upload();
+		if (DirtyFirst <= DirtyLast)
+			updateTable();
+
+		std::lock_guard<std::mutex> lock(Mutex);
+		Queued = (int)Requests.size();
+	}
+
+private:
+	// visible tiles before prefetches, then by screen space error
+	struct Request
+	{
+		bool Visible;
+		float Priority;
+		uint32_t Tile;
+
+		bool operator<(const Request& other) const
+		{
+			return Visible != other.Visible ? other.Visible : Priority < other.Priority;
+		}
+	};
+
+	TerrainFile File;
+	ThreadPool* Pool = nullptr;
+	int StreamedLevels = 0;
+	std::vector<glm::vec4> TileLevels;
+	std::vector<glm::vec2> LevelSizes;
+	uint32_t Frame = 0;
+
+	// per tile
+	std::vector<uint16_t> PageOf;
+	std::vector<uint32_t> WantedFrame;
+	std::vector<uint32_t> PrefetchFrame;
+	// per level 0 tile
+	std::vector<uint8_t> WantedLevels;
+	std::vector<uint32_t> Table;
+	// tiles whose page or wanted level changed since the table was last uploaded, none while first > last
+	uint32_t DirtyFirst = UINT32_MAX;
+	uint32_t DirtyLast = 0;
+	// per page
+	std::vector<uint32_t> PageTile;
+	std::vector<uint32_t> PageUsed;
+
+	// requested and not uploaded yet, GL thread only
+	std::unordered_set<uint32_t> Pending;
+	std::deque<uint32_t> Uploads;
+
+	TileCache Cache;
+	std::mutex Mutex;
+	// max heap
+	std::vector<Request> Requests;
+	std::vector<uint32_t> Ready;
+	bool Stopping = false;
+
+	GLuint PageTexture = 0;
+	GLuint TableBuffer = 0;
+	GLuint TableTexture = 0;
+
+	uint32_t tileIndex(int l, uint32_t x, uint32_t y) const
+	{
+		const TerrainLevel& lv = File.level(l);
+		return lv.FirstTile + y * lv.TilesX + x;
+	}
+
+	// texture coordinates covered by a tile
+	void tileRect(int l, uint32_t x, uint32_t y, glm::vec2& uv0, glm::vec2& uv1) const
+	{
+		const TerrainLevel& lv = File.level(l);
+		uint32_t size = File.header().TileSize;
+		uv0 = glm::vec2((float)(x * size) / lv.Width, (float)(y * size) / lv.Height);
+		uv1 = glm::vec2((float)std::min((x + 1) * size, lv.Width) / lv.Width, (float)std::min((y + 1) * size, lv.Height) / lv.Height);
+	}
+
+	void visit(const TileView& view, float pixelsPerUnit, bool prefetch, int l, uint32_t x, uint32_t y)
+	{
+		const glm::vec3& camera = view.Camera;
+		const TerrainFileHeader& header = File.header();
+		const TerrainTile& tile = File.tile(l, x, y);
+		glm::vec2 uv0, uv1;
+		tileRect(l, x, y, uv0, uv1);
+		glm::vec3 boxMin((uv0.x - 0.5f) * header.Width, tile.MinHeight, (uv0.y - 0.5f) * header.Height);
+		glm::vec3 boxMax((uv1.x - 0.5f) * header.Width, tile.MaxHeight, (uv1.y - 0.5f) * header.Height);
+		if (!view.View.intersectsBox(boxMin, boxMax))
+			return;
+
+		// size on screen of one sample of the parent level at the nearest point of the tile
+		glm::vec3 d = glm::max(glm::max(boxMin - camera, camera - boxMax), glm::vec3(0.0f));
+		float distance = std::max(std::sqrt(glm::dot(d, d)), 0.001f);
+		float parentSpacing = (float)header.Width / File.level(l + 1).Width;
+		float error = parentSpacing * pixelsPerUnit / distance;
+		if (error <= TargetError)
+			return;
+
+		if (prefetch)
+			wantAhead(l, x, y, error);
+		else
+			want(l, x, y, uv0, uv1, error);
+
+		if (l == 0)
+			return;
+		// the last tile of a row also owns the leftover tile of an odd sized child level
+		const TerrainLevel& lv = File.level(l);
+		const TerrainLevel& child = File.level(l - 1);
+		uint32_t cx1 = x + 1 == lv.TilesX ? child.TilesX - 1 : std::min(x * 2 + 1, child.TilesX - 1);
+		uint32_t cy1 = y + 1 == lv.TilesY ? child.TilesY - 1 : std::min(y * 2 + 1, child.TilesY - 1);
+		for (uint32_t cy = std::min(y * 2, child.TilesY - 1); cy <= cy1; cy++)
+			for (uint32_t cx = std::min(x * 2, child.TilesX - 1); cx <= cx1; cx++)
+				visit(view, pixelsPerUnit, prefetch, l - 1, cx, cy);
+	}
+
+	void want(int l, uint32_t x, uint32_t y, const glm::vec2& uv0, const glm::vec2& uv1, float error)
+	{
+		uint32_t index = tileIndex(l, x, y);
+		WantedFrame[index] = Frame;
+		Wanted++;
+
+		// level 0 tiles under this one sample at least this level
+		const TerrainLevel& base = File.level(0);
+		float size = (float)File.header().TileSize;
+		uint32_t x0 = std::min((uint32_t)(uv0.x * base.Width / size), base.TilesX - 1);
+		uint32_t y0 = std::min((uint32_t)(uv0.y * base.Height / size), base.TilesY - 1);
+		uint32_t x1 = std::min((uint32_t)std::ceil(uv1.x * base.Width / size), base.TilesX);
+		uint32_t y1 = std::min((uint32_t)std::ceil(uv1.y * base.Height / size), base.TilesY);
+		for (uint32_t ty = y0; ty < std::max(y1, y0 + 1); ty++)
+		{
+			for (uint32_t tx = x0; tx < std::max(x1, x0 + 1); tx++)
+			{
+				uint8_t& wanted = WantedLevels[(size_t)ty * base.TilesX + tx];
+				wanted = std::min(wanted, (uint8_t)l);
+			}
+		}
+
+		if (PageOf[index] != TILE_NO_PAGE)
+			PageUsed[PageOf[index]] = Frame;
+		else
+			request(index, true, error);
+	}
+
+	void wantAhead(int l, uint32_t x, uint32_t y, float error)
+	{
+		uint32_t index = tileIndex(l, x, y);
+		if (WantedFrame[index] == Frame || PrefetchFrame[index] == Frame)
+			return;
+		PrefetchFrame[index] = Frame;
+		Prefetched++;
+		// kept over older pages but still free for anything the current view needs
+		if (PageOf[index] != TILE_NO_PAGE)
+			PageUsed[PageOf[index]] = std::max(PageUsed[PageOf[index]], Frame - 1);
+		else
+			request(index, false, error);
+	}
+
+	void request(uint32_t index, bool visible, float error)
+	{
+		if (Pending.count(index))
+			return;
+		Pending.insert(index);
+		if (Cache.find(index))
+		{
+			Uploads.push_back(index);
+			return;
+		}
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Requests.push_back({ visible, error, index });
+			std::push_heap(Requests.begin(), Requests.end());
+		}
+		// every task loads whatever is most important by the time it runs
+		Pool->submit([this] { loadNext(); });
+	}
+
+	// drops the queued requests no view asked for this frame, and moves prefetches that became visible up
+	void cancelStale()
+	{
+		std::lock_guard<std::mutex> lock(Mutex);
+		size_t kept = 0;
+		for (const Request& r : Requests)
+		{
+			if (WantedFrame[r.Tile] != Frame && PrefetchFrame[r.Tile] != Frame)
+			{
+				Pending.erase(r.Tile);
+				Cancelled++;
+				continue;
+			}
+			Requests[kept] = r;
+			Requests[kept].Visible = WantedFrame[r.Tile] == Frame;
+			kept++;
+		}
+		Requests.resize(kept);
+		std::make_heap(Requests.begin(), Requests.end());
+	}
+
+	// worker side, the copy out of the mapping is where the page faults and disk reads happen
+	void loadNext()
+	{
+		uint32_t index;
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			if (Stopping || Requests.empty())
+				return;
+			std::pop_heap(Requests.begin(), Requests.end());
+			index = Requests.back().Tile;
+			Requests.pop_back();
+		}
+		const unsigned char* src = (const unsigned char*)File.tileData(File.tile(index));
+		auto data = std::make_shared<std::vector<unsigned char>>(src, src + File.tileBytes());
+		Cache.insert(index, std::move(data));
+		std::lock_guard<std::mutex> lock(Mutex);
+		Ready.push_back(index);
+	}
+
+	int allocatePage(bool visible)
+	{
+		if (Resident < PoolPages)
+			return Resident++;
+		// least recently used page that is not wanted this frame, prefetches also leave the other prefetches alone
+		uint32_t before = visible ? Frame : Frame - 1;
+		int oldest = -1;
+		for (int p = 0; p < PoolPages; p++)
+			if (PageUsed[p] < before && (oldest < 0 || PageUsed[p] < PageUsed[oldest]))
+				oldest = p;
+		if (oldest >= 0)
+		{
+			PageOf[PageTile[oldest]] = TILE_NO_PAGE;
+			markDirty(PageTile[oldest]);
+		}
+		return oldest;
+	}
+
+	void upload()
+	{
+		{
+			std::lock_guard<std::mutex> lock(Mutex);
+			Uploads.insert(Uploads.end(), Ready.begin(), Ready.end());
+			Ready.clear();
+		}
+
+		// visible tiles go first
+		std::stable_partition(Uploads.begin(), Uploads.end(), [this](uint32_t index) { return WantedFrame[index] == Frame; });
+
+		bool is16 = File.format() == HEIGHT_R16;
+		GLsizei stride = (GLsizei)File.tileStride();
+		auto start = std::chrono::steady_clock::now();
+		glBindTexture(GL_TEXTURE_2D_ARRAY, PageTexture);
+		glPixelStorei(GL_UNPACK_ALIGNMENT, is16 ? 2 : 4);
+		while (!Uploads.empty())
+		{
+			if (Uploaded > 0 && std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count() > UploadBudgetMs)
+				break;
+			uint32_t index = Uploads.front();
+			// tiles that are no longer wanted stay in the cache for later
+			bool visible = WantedFrame[index] == Frame;
+			if (PageOf[index] != TILE_NO_PAGE || (!visible && PrefetchFrame[index] != Frame))
+			{
+				Uploads.pop_front();
+				Pending.erase(index);
+				continue;
+			}
+			TileData data = Cache.find(index);
+			if (!data)
+			{
+				// evicted from the cache before it got its turn, requested again next frame
+				Uploads.pop_front();
+				Pending.erase(index);
+				continue;
+			}
+			int page = allocatePage(visible);
+			if (page < 0)
+				break;
+			Uploads.pop_front();
+			Pending.erase(index);
+			glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, page, stride, stride, 1, GL_RED, is16 ? GL_UNSIGNED_SHORT : GL_FLOAT, data->data());
+			PageTile[page] = index;
+			PageOf[index] = (uint16_t)page;
+			PageUsed[page] = visible ? Frame : Frame - 1;
+			markDirty(index);
+			Uploaded++;
+		}
+		glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+	}
+
+	void markDirty(uint32_t index)
+	{
+		DirtyFirst = std::min(DirtyFirst, index);
+		DirtyLast = std::max(DirtyLast, index);
+	}
+
+	// rebuilds and uploads only the dirty range, the wanted level is only read from the finest tiles
+	void updateTable()
+	{
+		uint32_t first = File.level(0).FirstTile, finest = (uint32_t)WantedLevels.size();
+		for (uint32_t t = DirtyFirst; t <= DirtyLast; t++)
+		{
+			Table[t] = PageOf[t];
+			if (t >= first && t - first < finest)
+				Table[t] |= (uint32_t)WantedLevels[t - first] << 16;
+		}
+		glBindBuffer(GL_TEXTURE_BUFFER, TableBuffer);
+		glBufferSubData(GL_TEXTURE_BUFFER, DirtyFirst * sizeof(uint32_t), (DirtyLast - DirtyFirst + 1) * sizeof(uint32_t), &Table[DirtyFirst]);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		DirtyFirst = UINT32_MAX;
+		DirtyLast = 0;
+	}
+};
+
+#endif